@@ -1,9 +1,26 @@
 #include <cstdio>
 #include <cassert>
 #include "BHNode.h"
+#include "FMMPotential.h"
 
-BHNode::BHNode(const Complex& center, const Complex& size, const int depth, int maxDepth)
-: center(center), size(size), hasChildren(false), depth(depth), maxDepth(maxDepth)
+long BHNode::flops = 0;
+
+long BHNode::TotalFlops()
+{
+	long total = 0;
+	#pragma omp parallel reduction(+:total)
+	total += BHNode::flops;
+	return total;
+}
+
+void BHNode::ResetFlops()
+{
+	#pragma omp parallel
+	BHNode::flops = 0;
+}
+
+BHNode::BHNode(const Complex& center, const Complex& size, const int depth, int maxDepth, const Kernel* kernel)
+: center(center), size(size), hasChildren(false), depth(depth), maxDepth(maxDepth), kernel(kernel)
 {
 	if (depth == 0) 
 		BHNode::flops = 0;
@@ -38,7 +55,7 @@ void BHNode::CreateChild(const int quadrant)
 		case 2: center -= size; break;
 		case 3: center += conj(size); break;
 	}
-	children[quadrant] = new BHNode(center, size, depth, maxDepth);
+	children[quadrant] = new BHNode(center, size, depth, maxDepth, kernel);
 	hasChild[quadrant] = true;
 	hasChildren = true;
 }
@@ -84,11 +101,14 @@ int BHNode::AddSource(Point* source)
 void BHNode::ComputeChargeDistribution() 
 {
 	charge = 0;
+	absoluteCharge = 0;
 	centerOfCharge = Complex(0, 0);
+	INSTRUMENT_COUNT(CountBHVisits, 1);
 	if (sources.size() > 0) {
 		for (auto &source : sources) {
-			charge += 1.0;
-			centerOfCharge += Complex(source->coord);
+			charge += source->charge;
+			absoluteCharge += fabs(source->charge);
+			centerOfCharge += source->coord * fabs(source->charge);
 			BHNode::flops++;
 		}
 	} else {
@@ -96,16 +116,21 @@ void BHNode::ComputeChargeDistribution()
 			if (hasChild[quadrant]) {
 				children[quadrant]->ComputeChargeDistribution();
 				charge += children[quadrant]->charge;
-				centerOfCharge += (children[quadrant]->centerOfCharge * children[quadrant]->charge);
+				absoluteCharge += children[quadrant]->absoluteCharge;
+				centerOfCharge += (children[quadrant]->centerOfCharge * children[quadrant]->absoluteCharge);
 				BHNode::flops++;
 			}
 		}
 	}
-	centerOfCharge /= charge;
+	if (absoluteCharge > 0)
+		centerOfCharge /= absoluteCharge;
+	else
+		centerOfCharge = center;
 }
 
 double BHNode::ComputePotential(const Point* target, const double theta)
 {
+	INSTRUMENT_COUNT(CountBHVisits, 1);
 	if (sources.size() > 0)
 		return ComputePotentialDirect(sources, target);
 
@@ -114,7 +139,9 @@ double BHNode::ComputePotential(const Point* target, const double theta)
 
 	if (ratio > theta) {
 		BHNode::flops++;
-		return charge * real(log(target->coord - centerOfCharge));
+		// a monopole evaluation, counted apart from the direct pairs of the leaves
+		INSTRUMENT_KERNEL(CountBHFarField, 1, Potential::P2PCost());
+		return charge * Interaction(target->coord - centerOfCharge);
 	} else {
 		double potential = 0;
 		for (int quadrant = 0; quadrant < 4; quadrant++)
@@ -128,9 +155,10 @@ double BHNode::ComputePotentialDirect(const std::vector<Point*>& sources, const
 	double potential = 0;
 	for (auto &source : sources) {
 		if (source->coord != target->coord) {
-			potential += real(log(target->coord - source->coord));
+			potential += source->charge * Interaction(target->coord - source->coord);
 			BHNode::flops++;
 		}
 	}
+	INSTRUMENT_KERNEL(CountP2PPairs, sources.size(), Potential::P2PCost());
 	return potential;
 }
\ No newline at end of file
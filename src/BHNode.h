@@ -3,8 +3,9 @@
 
 #include "GeneralUtilities.h"
 #include "Point.h"
+#include "Kernel.h"
 
-/// Barnes-Hut Treecode, Adaptive Quadtree, 2D Coulomb Potential
+/// Barnes-Hut Treecode, Adaptive Quadtree, 2D Coulomb Potential or any other kernel
 class BHNode {
 
 public:
@@ -26,12 +27,21 @@ public:
 	int maxDepth;
 	/// Total charge in this node
 	double charge;
-	/// Center of total charge
+	/// Total absolute charge in this node, the weight of centerOfCharge
+	double absoluteCharge;
+	/// Center of total charge, weighted by absolute charge
 	Complex centerOfCharge;
-	/// FLOP counter
+	/// Interaction kernel, shared by the whole tree; null for the analytic log potential
+	const Kernel* kernel;
+	/// FLOP counter, one per thread
 	static long flops;
+	#pragma omp threadprivate(flops)
+	/// Sum of the FLOP counters of all threads
+	static long TotalFlops();
+	/// Reset the FLOP counters of all threads
+	static void ResetFlops();
 	/// Constructor
-	BHNode(const Complex& center, const Complex& size, const int depth, int maxDepth);
+	BHNode(const Complex& center, const Complex& size, const int depth, int maxDepth, const Kernel* kernel = 0);
 	/// Destructor
 	~BHNode();
 	/// Get index of quadrant for a coordinate
@@ -46,6 +56,8 @@ public:
 	void ComputeChargeDistribution();
 	/// Compute the approximate potential due to the charge distribution of this node (recursive)
 	double ComputePotential(const Point* target, const double theta);
+	/// Potential of a unit charge at displacement z
+	inline double Interaction(const Complex& z) const { return kernel ? kernel->Evaluate(norm(z)) : real(log(z)); }
 	/// Compute the potential directoy due to a collection of sources
 	double ComputePotentialDirect(const std::vector<Point*>& sources, const Point* target);
 };
@@ -0,0 +1,436 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <omp.h>
+#include "MLFMM.h"
+#include "BHNode.h"
+#include "Tuner.h"
+#include "Distributions.h"
+#include "Verification.h"
+#include "ParticleIO.h"
+#include "ChebyshevPotential.h"
+#include "Solver.h"
+
+/// Command line options of the benchmark
+struct Options {
+    std::string solver = "fmm";
+    std::string distribution = "uniform";
+    std::string kernel = "log";
+    std::string csv;
+    std::string json;
+    std::string input;
+    std::string output;
+    std::string save;
+    int N = 10000;
+    int levels = 0;
+    int degree = 0;
+    int nodes = 0;
+    int depth = 0;
+    int threads = 0;
+    int repeats = 5;
+    double theta = 2.0;
+    double scale = 0.1;
+    double tolerance = 1.0e-6;
+    unsigned seed = 1;
+    bool perf = false;
+    bool periodic = false;
+    bool numa = false;
+    int verify = 0;
+    int strata = 0;
+};
+
+/// Repeated wall-clock timings of one phase
+struct Phase {
+    std::string name;
+    std::vector<double> samples;
+    double median, mad, min, max;
+};
+
+void PrintUsage(const char* program) {
+    printf("usage: %s [options]\n", program);
+    printf("  --solver fmm|bh|direct|auto  solver to benchmark, auto to let Solver choose for --tol (fmm)\n");
+    printf("  --n N                        number of particles (10000)\n");
+    printf("  --dist uniform|plummer|line|ring  particle distribution (uniform)\n");
+    printf("  --levels L                   FMM tree levels, 0 to auto-tune (0)\n");
+    printf("  --degree p                   FMM truncation number, 0 to derive from --tol (0)\n");
+    printf("  --tol eps                    target accuracy for auto-tuning (1e-6)\n");
+    printf("  --kernel log|yukawa|gaussian interaction kernel (log)\n");
+    printf("  --scale s                    screening length of yukawa, width of gaussian (0.1)\n");
+    printf("  --nodes n                    Chebyshev nodes per dimension for other kernels than log,\n");
+    printf("                               0 for the analytic log expansions or 8 for the others (0)\n");
+    printf("  --theta t                    Barnes-Hut opening parameter (2.0)\n");
+    printf("  --depth d                    Barnes-Hut maximum depth, 0 for log4(N) (0)\n");
+    printf("  --threads T                  OpenMP threads, 0 for the default (0)\n");
+    printf("  --repeat R                   repetitions per phase (5)\n");
+    printf("  --seed s                     random seed (1)\n");
+    printf("  --input file                 read particles from a binary particle file instead of --dist\n");
+    printf("  --output file                write the potentials of the last repetition to a binary file\n");
+    printf("  --save file                  write the particles to a binary particle file\n");
+    printf("  --csv file                   append results to a CSV file\n");
+    printf("  --json file                  write results to a JSON file\n");
+    printf("  --verify S                   check S sampled targets against exact sums, 0 to skip (0)\n");
+    printf("  --strata l                   stratify the verification sample by the boxes of level l (0)\n");
+    printf("  --periodic on|off            periodic boundary conditions on the unit square, fmm only (off)\n");
+    printf("  --numa on|off                pin threads to NUMA nodes and place boxes on them, fmm only (off)\n");
+    printf("  --perf on|off                read hardware counters per phase, needs INSTRUMENT=1 (off)\n");
+}
+
+bool ParseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string key = argv[i];
+        if (key == "--help" || key == "-h" || i + 1 >= argc)
+            return false;
+        const char* value = argv[++i];
+        if      (key == "--solver")  options.solver = value;
+        else if (key == "--n")       options.N = atoi(value);
+        else if (key == "--dist")    options.distribution = value;
+        else if (key == "--levels")  options.levels = atoi(value);
+        else if (key == "--degree")  options.degree = atoi(value);
+        else if (key == "--tol")     options.tolerance = atof(value);
+        else if (key == "--kernel")  options.kernel = value;
+        else if (key == "--scale")   options.scale = atof(value);
+        else if (key == "--nodes")   options.nodes = atoi(value);
+        else if (key == "--theta")   options.theta = atof(value);
+        else if (key == "--depth")   options.depth = atoi(value);
+        else if (key == "--threads") options.threads = atoi(value);
+        else if (key == "--repeat")  options.repeats = atoi(value);
+        else if (key == "--seed")    options.seed = atoi(value);
+        else if (key == "--input")   options.input = value;
+        else if (key == "--output")  options.output = value;
+        else if (key == "--save")    options.save = value;
+        else if (key == "--csv")     options.csv = value;
+        else if (key == "--json")    options.json = value;
+        else if (key == "--verify")  options.verify = atoi(value);
+        else if (key == "--strata")  options.strata = atoi(value);
+        else if (key == "--perf")    options.perf = (std::string(value) == "on");
+        else if (key == "--periodic") options.periodic = (std::string(value) == "on");
+        else if (key == "--numa")    options.numa = (std::string(value) == "on");
+        else return false;
+    }
+    return options.N > 0 && options.repeats > 0
+        && (options.solver == "fmm" || options.solver == "bh" || options.solver == "direct" || options.solver == "auto")
+        && (options.solver != "auto" || options.kernel == "log")
+        && (options.kernel == "log" || options.kernel == "yukawa" || options.kernel == "gaussian")
+        && (!options.periodic || (options.solver == "fmm" && options.kernel == "log" && options.nodes == 0))
+        && (!options.numa || options.solver == "fmm");
+}
+
+double Median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    int n = values.size();
+    return (n % 2) ? values[n / 2] : 0.5 * (values[n / 2 - 1] + values[n / 2]);
+}
+
+void Summarize(Phase& phase) {
+    phase.median = Median(phase.samples);
+    std::vector<double> deviations;
+    for (auto &sample : phase.samples)
+        deviations.push_back(fabs(sample - phase.median));
+    phase.mad = Median(deviations);
+    phase.min = *std::min_element(phase.samples.begin(), phase.samples.end());
+    phase.max = *std::max_element(phase.samples.begin(), phase.samples.end());
+}
+
+/// Kernel selected by --kernel, null for the analytic log potential
+Kernel* MakeKernel(const Options& options) {
+    if (options.kernel == "yukawa")
+        return new YukawaKernel(1.0 / options.scale);
+    if (options.kernel == "gaussian")
+        return new GaussianKernel(options.scale);
+    return options.nodes > 0 ? new LogKernel() : 0;
+}
+
+/// Potential of a kernel: the analytic expansions for null, Chebyshev interpolation otherwise
+Potential* MakePotential(const Options& options, const Kernel* kernel) {
+    if (kernel)
+        return new ChebyshevPotential(*kernel, options.nodes);
+    return new Potential(options.degree);
+}
+
+/// Time the phases of MLFMM::Solve(), returns the FLOP count of the last repetition or -1 if the
+/// tree rejects the configuration
+long BenchmarkFMM(const Options& options, const Kernel* kernel, std::vector<Point*>& points, std::vector<Phase>& phases) {
+    const char* names[] = { "build", "P2M", "M2M", "M2L", "L2L", "L2P", "P2P", "total" };
+    for (auto &name : names)
+        phases.push_back(Phase{ name, {}, 0, 0, 0, 0 });
+    long flops = 0;
+    Timer timer, total;
+    for (int repeat = 0; repeat < options.repeats; repeat++) {
+        std::unique_ptr<Potential> potential(MakePotential(options, kernel));
+        Instrumentation::Reset();
+        total.Start();
+        timer.Start();
+        MLFMM tree(options.levels, *potential);
+        tree.periodic = options.periodic;
+        {
+            INSTRUMENT_PHASE(PhaseBuild);
+            for (auto &point : points) {
+                tree.AddSource(point);
+                tree.AddTarget(point);
+            }
+        }
+        if (options.numa)
+            tree.DistributeForNUMA();
+        // the checks and the periodic degrees of Solve()
+        if (!tree.Prepare())
+            return -1;
+        phases[0].samples.push_back(timer.Elapsed());
+        tree.ClearExpansions();
+        timer.Start(); tree.MultipoleExpansion();              phases[1].samples.push_back(timer.Elapsed());
+        timer.Start(); tree.MultipoleToMultipoleTranslation(); phases[2].samples.push_back(timer.Elapsed());
+        timer.Start(); tree.MultipoleToLocalTranslation();     phases[3].samples.push_back(timer.Elapsed());
+        timer.Start(); tree.LocalToLocalTranslation();         phases[4].samples.push_back(timer.Elapsed());
+        timer.Start(); tree.LocalExpansion();                  phases[5].samples.push_back(timer.Elapsed());
+        timer.Start(); tree.NearFieldInteraction();            phases[6].samples.push_back(timer.Elapsed());
+        phases[7].samples.push_back(total.Elapsed());
+        flops = tree.flops;
+    }
+    return flops;
+}
+
+/// Time the Barnes-Hut tree build, charge distribution and evaluation
+long BenchmarkBH(const Options& options, const Kernel* kernel, std::vector<Point*>& points, std::vector<Phase>& phases) {
+    const char* names[] = { "build", "charge", "evaluate", "total" };
+    for (auto &name : names)
+        phases.push_back(Phase{ name, {}, 0, 0, 0, 0 });
+    long flops = 0;
+    Timer timer, total;
+    for (int repeat = 0; repeat < options.repeats; repeat++) {
+        Instrumentation::Reset();
+        total.Start();
+        timer.Start();
+        BHNode tree(Complex(0.5, 0.5), Complex(0.5, 0.5), 0, options.depth, kernel);
+        {
+            INSTRUMENT_PHASE(PhaseBuild);
+            for (auto &point : points)
+                tree.AddSource(point);
+        }
+        phases[0].samples.push_back(timer.Elapsed());
+        BHNode::ResetFlops();
+        timer.Start();
+        {
+            INSTRUMENT_PHASE(PhaseBHCharge);
+            tree.ComputeChargeDistribution();
+        }
+        phases[1].samples.push_back(timer.Elapsed());
+        timer.Start();
+        {
+            INSTRUMENT_PHASE(PhaseBHEvaluate);
+            #pragma omp parallel for schedule(dynamic, 64)
+            for (int index = 0; index < points.size(); index++)
+                points[index]->potential = tree.ComputePotential(points[index], options.theta);
+        }
+        phases[2].samples.push_back(timer.Elapsed());
+        phases[3].samples.push_back(total.Elapsed());
+        flops = BHNode::TotalFlops();
+    }
+    return flops;
+}
+
+/// Time the O(N^2) direct sum
+long BenchmarkDirect(const Options& options, const Kernel* kernel, std::vector<Point*>& points, std::vector<Phase>& phases) {
+    phases.push_back(Phase{ "direct", {}, 0, 0, 0, 0 });
+    std::unique_ptr<Potential> potential(MakePotential(options, kernel));
+    Timer timer;
+    for (int repeat = 0; repeat < options.repeats; repeat++) {
+        Instrumentation::Reset();
+        INSTRUMENT_PHASE(PhaseDirect);
+        timer.Start();
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < points.size(); i++) {
+            double sum = 0;
+            for (int j = 0; j < points.size(); j++)
+                if (i != j)
+                    sum += points[j]->charge * potential->DirectEvaluate(points[i]->coord, points[j]->coord);
+            points[i]->potential = sum;
+            INSTRUMENT_KERNEL(CountP2PPairs, points.size() - 1, Potential::P2PCost());
+        }
+        phases[0].samples.push_back(timer.Elapsed());
+    }
+    return (long)points.size() * (points.size() - 1);
+}
+
+/// Time Solver::Solve(), including its choice of engine
+long BenchmarkAuto(const Options& options, Solver& solver, std::vector<Point*>& points, std::vector<Phase>& phases) {
+    phases.push_back(Phase{ "total", {}, 0, 0, 0, 0 });
+    Timer timer;
+    for (int repeat = 0; repeat < options.repeats; repeat++) {
+        Instrumentation::Reset();
+        timer.Start();
+        solver.Solve(points);
+        phases[0].samples.push_back(timer.Elapsed());
+    }
+    return solver.flops;
+}
+
+void WriteCSV(const std::string& path, const Options& options, const std::vector<Phase>& phases,
+    long flops, const std::string& timestamp, const std::string& host) {
+    FILE* file = fopen(path.c_str(), "a");
+    if (!file) {
+        fprintf(stderr, "cannot open %s\n", path.c_str());
+        return;
+    }
+    if (ftell(file) == 0)
+        fprintf(file, "timestamp,host,solver,distribution,N,levels,degree,theta,depth,threads,repeats,flops,phase,median,mad,min,max\n");
+    for (auto &phase : phases)
+        fprintf(file, "%s,%s,%s,%s,%d,%d,%d,%g,%d,%d,%d,%ld,%s,%.6e,%.6e,%.6e,%.6e\n",
+            timestamp.c_str(), host.c_str(), options.solver.c_str(), options.distribution.c_str(),
+            options.N, options.levels, options.degree, options.theta, options.depth, options.threads,
+            options.repeats, flops, phase.name.c_str(), phase.median, phase.mad, phase.min, phase.max);
+    fclose(file);
+}
+
+void WriteJSON(const std::string& path, const Options& options, const std::vector<Phase>& phases,
+    long flops, const SampledError* error, const std::string& timestamp, const std::string& host) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        fprintf(stderr, "cannot open %s\n", path.c_str());
+        return;
+    }
+    fprintf(file, "{\n");
+    fprintf(file, "  \"timestamp\": \"%s\",\n  \"host\": \"%s\",\n", timestamp.c_str(), host.c_str());
+    fprintf(file, "  \"solver\": \"%s\",\n  \"distribution\": \"%s\",\n", options.solver.c_str(), options.distribution.c_str());
+    fprintf(file, "  \"N\": %d,\n  \"levels\": %d,\n  \"degree\": %d,\n  \"theta\": %g,\n  \"depth\": %d,\n",
+        options.N, options.levels, options.degree, options.theta, options.depth);
+    fprintf(file, "  \"threads\": %d,\n  \"repeats\": %d,\n  \"flops\": %ld,\n", options.threads, options.repeats, flops);
+    if (error)
+        fprintf(file, "  \"verification\": {\"samples\": %d, \"avgAbsError\": %.6e, \"avgAbsErrorCI\": %.6e, "
+            "\"avgRelError\": %.6e, \"avgRelErrorCI\": %.6e, \"maxAbsError\": %.6e, \"maxRelError\": %.6e, \"exceedanceBound\": %.6e},\n",
+            error->samples, error->avgAbsError, error->avgAbsErrorCI, error->avgRelError, error->avgRelErrorCI,
+            error->maxAbsError, error->maxRelError, error->exceedanceBound);
+    fprintf(file, "  \"phases\": [\n");
+    for (int i = 0; i < phases.size(); i++) {
+        const Phase& phase = phases[i];
+        fprintf(file, "    {\"name\": \"%s\", \"median\": %.6e, \"mad\": %.6e, \"min\": %.6e, \"max\": %.6e, \"samples\": [",
+            phase.name.c_str(), phase.median, phase.mad, phase.min, phase.max);
+        for (int j = 0; j < phase.samples.size(); j++)
+            fprintf(file, "%s%.6e", j ? ", " : "", phase.samples[j]);
+        fprintf(file, "]}%s\n", i + 1 < phases.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options)) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    // one contiguous block of points, either mapped from a file or generated
+    std::vector<Point> storage;
+    std::vector<Point*> points;
+    if (!options.input.empty()) {
+        ParticleFile file;
+        if (!file.Open(options.input))
+            return 1;
+        LoadPoints(file, storage, points);
+        options.N = points.size();
+        options.distribution = "file";
+    } else {
+        Coordinates coords = GenerateDistribution(options.distribution, options.N, options.seed);
+        if (coords.empty()) {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+        storage.reserve(options.N);
+        for (int index = 0; index < options.N; index++) {
+            storage.emplace_back(coords[index], index);
+            points.push_back(&storage.back());
+        }
+    }
+    if (!options.save.empty() && !ParticleFile::Write(options.save, points))
+        return 1;
+    if (options.threads > 0)
+        omp_set_num_threads(options.threads);
+    options.threads = omp_get_max_threads();
+    if (options.perf && !Instrumentation::EnablePerfCounters())
+        fprintf(stderr, "hardware counters are not available (perf_event_open failed)\n");
+
+    std::unique_ptr<Kernel> kernel(MakeKernel(options));
+    if (kernel && options.nodes <= 0)
+        options.nodes = 8;
+    if (kernel)
+        options.degree = options.nodes * options.nodes;
+    if (options.solver == "fmm") {
+        if (options.degree <= 0)
+            options.degree = Potential::DegreeForTolerance(options.tolerance);
+        // periodic trees need 3 levels; an explicit --levels below that is rejected by MLFMM::Prepare()
+        if (options.levels <= 0) {
+            options.levels = Tuner().Tune(points, Potential::TruncationError(options.degree)).levels;
+            if (options.periodic)
+                options.levels = std::max(options.levels, 3);
+        }
+    }
+    if (options.solver == "bh" && options.depth <= 0)
+        options.depth = std::max(3, (int)round(log((double)options.N) / log(4.0) + 0.5));
+
+    std::vector<Phase> phases;
+    long flops = 0;
+    if (options.solver == "fmm") {
+        flops = BenchmarkFMM(options, kernel.get(), points, phases);
+        if (flops < 0)
+            return 1;
+    }
+    else if (options.solver == "bh")
+        flops = BenchmarkBH(options, kernel.get(), points, phases);
+    else if (options.solver == "auto") {
+        Solver solver(options.tolerance);
+        flops = BenchmarkAuto(options, solver, points, phases);
+        printf("# auto: %s\n", solver.Report().c_str());
+        options.solver = Solver::EngineName(solver.engine);
+        options.levels = solver.levels;
+        options.degree = solver.degree;
+        options.theta = solver.theta;
+        options.depth = solver.depth;
+    }
+    else
+        flops = BenchmarkDirect(options, kernel.get(), points, phases);
+
+    printf("# solver=%s kernel=%s dist=%s N=%d levels=%d degree=%d theta=%g depth=%d threads=%d repeats=%d flops=%ld\n",
+        options.solver.c_str(), options.kernel.c_str(), options.distribution.c_str(), options.N, options.levels, options.degree,
+        options.theta, options.depth, options.threads, options.repeats, flops);
+    printf("%10s %12s %12s %12s %12s\n", "phase", "median", "mad", "min", "max");
+    for (auto &phase : phases) {
+        Summarize(phase);
+        printf("%10s %12.6f %12.6f %12.6f %12.6f\n", phase.name.c_str(), phase.median, phase.mad, phase.min, phase.max);
+    }
+    if (!options.output.empty()) {
+        PotentialFile output;
+        if (!output.Create(options.output, points.size()))
+            return 1;
+        output.Store(points);
+    }
+    // potentials of the last repetition against exact sums for a sample of targets
+    SampledError error;
+    bool verified = options.verify > 0 && options.solver != "direct";
+    if (verified) {
+        std::unique_ptr<Potential> potential(MakePotential(options, kernel.get()));
+        Timer timer;
+        timer.Start();
+        error = VerifySampled(points, points, *potential, options.verify, options.seed, options.strata, options.periodic);
+        PrintSampledError(stdout, error);
+        printf("%20s %12.3f s\n", "verification time", timer.Elapsed());
+    }
+
+#ifdef INSTRUMENT
+    printf("# operation counts of the last repetition\n");
+    Instrumentation::Report(stdout);
+#endif
+    fflush(stdout);
+
+    char timestamp[32], host[256] = "unknown";
+    time_t now = time(0);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+    gethostname(host, sizeof(host) - 1);
+    if (!options.csv.empty())
+        WriteCSV(options.csv, options, phases, flops, timestamp, host);
+    if (!options.json.empty())
+        WriteJSON(options.json, options, phases, flops, verified ? &error : 0, timestamp, host);
+
+    return 0;
+}
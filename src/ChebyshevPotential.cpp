@@ -0,0 +1,224 @@
+#include "ChebyshevPotential.h"
+
+ChebyshevPotential::ChebyshevPotential(const Kernel& kernel, const int nodes)
+: Potential(nodes * nodes), kernel(kernel), nodes(nodes)
+{
+	roots.resize(nodes);
+	polynomials.resize(nodes * nodes);
+	for (int a = 0; a < nodes; a++) {
+		roots[a] = cos(M_PI * (2 * a + 1) / (2.0 * nodes));
+		for (int k = 0; k < nodes; k++)
+			polynomials[a * nodes + k] = cos(k * M_PI * (2 * a + 1) / (2.0 * nodes));
+	}
+	// a child half [-1, 0] or [0, 1] of the box maps its own nodes to (root -+ 1) / 2
+	std::vector<double> weights(nodes);
+	for (int half = 0; half < 2; half++) {
+		childWeights[half].resize(nodes * nodes);
+		for (int b = 0; b < nodes; b++) {
+			Weights(0.5 * (roots[b] + (half ? 1 : -1)), weights.data());
+			for (int a = 0; a < nodes; a++)
+				childWeights[half][a * nodes + b] = weights[a];
+		}
+	}
+}
+
+void ChebyshevPotential::Weights(const double u, double* weights) const
+{
+	// S(root_a, u) = 1/n + 2/n sum of T_k(root_a) T_k(u) over 0 < k < n
+	std::vector<double> t(nodes);
+	t[0] = 1;
+	if (nodes > 1)
+		t[1] = u;
+	for (int k = 2; k < nodes; k++)
+		t[k] = 2 * u * t[k - 1] - t[k - 2];
+	for (int a = 0; a < nodes; a++) {
+		double sum = 0;
+		for (int k = 1; k < nodes; k++)
+			sum += polynomials[a * nodes + k] * t[k];
+		weights[a] = (1.0 + 2.0 * sum) / nodes;
+	}
+}
+
+void ChebyshevPotential::PrecomputeOperators(const int levels)
+{
+	const int size = nodes * nodes;
+	if (m2l.size() < levels)
+		m2l.resize(levels);
+	// interaction lists start at level 2
+	for (int level = 2; level < levels; level++) {
+		if (!m2l[level].empty())
+			continue;
+		m2l[level].resize(49);
+		const double half = 0.5 * pow(2.0, -level);
+		#pragma omp parallel for schedule(dynamic)
+		for (int offset = 0; offset < 49; offset++) {
+			int dx = offset / 7 - 3, dy = offset % 7 - 3;
+			if (abs(dx) <= 1 && abs(dy) <= 1)
+				continue;
+			std::vector<double>& matrix = m2l[level][offset];
+			matrix.resize(size * size);
+			for (int m = 0; m < size; m++) {
+				double tx = roots[m / nodes] * half, ty = roots[m % nodes] * half;
+				for (int n = 0; n < size; n++) {
+					double sx = 2 * half * dx + roots[n / nodes] * half, sy = 2 * half * dy + roots[n % nodes] * half;
+					matrix[m * size + n] = kernel.Evaluate((tx - sx) * (tx - sx) + (ty - sy) * (ty - sy));
+				}
+			}
+		}
+	}
+}
+
+void ChebyshevPotential::ExportOperators(const int levels, std::vector<double>& table) const
+{
+	// operators of deeper levels, built for an earlier tree, are not part of this one
+	for (int level = 0; level < levels && level < m2l.size(); level++)
+		for (auto &matrix : m2l[level])
+			table.insert(table.end(), matrix.begin(), matrix.end());
+}
+
+bool ChebyshevPotential::ImportOperators(const int levels, const double* table, const size_t size)
+{
+	const size_t matrixSize = nodes * nodes * nodes * nodes;
+	if (size != (levels > 2 ? levels - 2 : 0) * 40 * matrixSize)
+		return false;
+	m2l.assign(levels, std::vector<std::vector<double>>());
+	for (int level = 2; level < levels; level++) {
+		m2l[level].resize(49);
+		for (int offset = 0; offset < 49; offset++) {
+			if (abs(offset / 7 - 3) <= 1 && abs(offset % 7 - 3) <= 1)
+				continue;
+			m2l[level][offset].assign(table, table + matrixSize);
+			table += matrixSize;
+		}
+	}
+	return true;
+}
+
+void ChebyshevPotential::EvaluateDirect(const double* tx, const double* ty, const int m,
+	const double* sx, const double* sy, const double* sq, const int n, double* potentials, const Complex& shift)
+{
+	const double shiftX = real(shift), shiftY = imag(shift);
+	for (int i = 0; i < m; i++) {
+		const double x = tx[i] - shiftX, y = ty[i] - shiftY;
+		double sum = 0;
+		for (int j = 0; j < n; j++) {
+			double dx = x - sx[j], dy = y - sy[j];
+			double r2 = dx * dx + dy * dy;
+			if (r2 > 0)
+				sum += sq[j] * kernel.Evaluate(r2);
+		}
+		potentials[i] += sum;
+	}
+}
+
+void ChebyshevPotential::EvaluateDirectMutual(const double* x1, const double* y1, const double* q1, const int n1, double* potentials1,
+	const double* x2, const double* y2, const double* q2, const int n2, double* potentials2, const Complex& shift)
+{
+	const double shiftX = real(shift), shiftY = imag(shift);
+	for (int i = 0; i < n1; i++) {
+		const double x = x1[i] - shiftX, y = y1[i] - shiftY;
+		double sum = 0;
+		for (int j = 0; j < n2; j++) {
+			double dx = x - x2[j], dy = y - y2[j];
+			double r2 = dx * dx + dy * dy;
+			if (r2 > 0) {
+				double g = kernel.Evaluate(r2);
+				sum += q2[j] * g;
+				potentials2[j] += q1[i] * g;
+			}
+		}
+		potentials1[i] += sum;
+	}
+}
+
+void ChebyshevPotential::EvaluateDirectSelf(const double* x, const double* y, const double* q, const int n, double* potentials)
+{
+	for (int i = 0; i + 1 < n; i++)
+		ChebyshevPotential::EvaluateDirectMutual(x + i, y + i, q + i, 1, potentials + i,
+			x + i + 1, y + i + 1, q + i + 1, n - i - 1, potentials + i + 1);
+}
+
+void ChebyshevPotential::BoxMultipoleExpansion(Box* box)
+{
+	const double scale = 2.0 / box->size;
+	std::vector<double> wx(nodes), wy(nodes);
+	ComplexVec& coeffs = box->externalMultipoleCoeffs;
+	for (int j = 0; j < box->sources.size(); j++) {
+		Weights((box->sourceX[j] - real(box->center)) * scale, wx.data());
+		Weights((box->sourceY[j] - imag(box->center)) * scale, wy.data());
+		for (int a = 0; a < nodes; a++) {
+			double charge = box->sourceQ[j] * wx[a];
+			for (int b = 0; b < nodes; b++)
+				coeffs[a * nodes + b] += charge * wy[b];
+		}
+	}
+}
+
+void ChebyshevPotential::BoxMultipoleToMultipole(const Box* child, Box* parent)
+{
+	const double* cx = childWeights[real(child->center) > real(parent->center)].data();
+	const double* cy = childWeights[imag(child->center) > imag(parent->center)].data();
+	const ComplexVec& in = child->externalMultipoleCoeffs;
+	ComplexVec& out = parent->externalMultipoleCoeffs;
+	// one dimension at a time: y into a temporary, then x into the parent
+	std::vector<double> partial(nodes * nodes, 0.0);
+	for (int c = 0; c < nodes; c++)
+		for (int b = 0; b < nodes; b++)
+			for (int d = 0; d < nodes; d++)
+				partial[c * nodes + b] += cy[b * nodes + d] * real(in[c * nodes + d]);
+	for (int a = 0; a < nodes; a++)
+		for (int c = 0; c < nodes; c++)
+			for (int b = 0; b < nodes; b++)
+				out[a * nodes + b] += cx[a * nodes + c] * partial[c * nodes + b];
+}
+
+void ChebyshevPotential::BoxMultipoleToLocal(const Box* source, Box* target, const Complex& shift)
+{
+	const int size = nodes * nodes;
+	const std::vector<double>& matrix = m2l[target->level][Offset(source->center + shift, target->center, target->size)];
+	const ComplexVec& in = source->externalMultipoleCoeffs;
+	ComplexVec& out = target->localMultipoleCoeffsTilde;
+	for (int m = 0; m < size; m++) {
+		double sum = 0;
+		for (int n = 0; n < size; n++)
+			sum += matrix[m * size + n] * real(in[n]);
+		out[m] += sum;
+	}
+}
+
+void ChebyshevPotential::BoxLocalToLocal(const Box* parent, Box* child)
+{
+	const double* cx = childWeights[real(child->center) > real(parent->center)].data();
+	const double* cy = childWeights[imag(child->center) > imag(parent->center)].data();
+	const ComplexVec& in = parent->localMultipoleCoeffs;
+	ComplexVec& out = child->localMultipoleCoeffs;
+	// the transpose of M2M: interpolate the parent's node values at the child's nodes
+	std::vector<double> partial(nodes * nodes, 0.0);
+	for (int a = 0; a < nodes; a++)
+		for (int d = 0; d < nodes; d++)
+			for (int b = 0; b < nodes; b++)
+				partial[a * nodes + d] += cy[b * nodes + d] * real(in[a * nodes + b]);
+	for (int c = 0; c < nodes; c++)
+		for (int a = 0; a < nodes; a++)
+			for (int d = 0; d < nodes; d++)
+				out[c * nodes + d] += cx[a * nodes + c] * partial[a * nodes + d];
+}
+
+void ChebyshevPotential::BoxLocalExpansion(const Box* box, const double* x, const double* y, const int n, double* potentials)
+{
+	const double scale = 2.0 / box->size;
+	std::vector<double> wx(nodes), wy(nodes);
+	const ComplexVec& coeffs = box->localMultipoleCoeffs;
+	for (int i = 0; i < n; i++) {
+		Weights((x[i] - real(box->center)) * scale, wx.data());
+		Weights((y[i] - imag(box->center)) * scale, wy.data());
+		double sum = 0;
+		for (int a = 0; a < nodes; a++) {
+			double row = 0;
+			for (int b = 0; b < nodes; b++)
+				row += real(coeffs[a * nodes + b]) * wy[b];
+			sum += row * wx[a];
+		}
+		potentials[i] += sum;
+	}
+}
@@ -0,0 +1,98 @@
+#ifndef ChebyshevPotential_h
+#define ChebyshevPotential_h
+
+#include "FMMPotential.h"
+#include "Kernel.h"
+
+/// Kernel-independent expansions by Chebyshev interpolation (black-box FMM) for any smooth kernel.
+/// The multipole expansion of a box holds equivalent charges at the nodes x nodes tensor Chebyshev
+/// nodes of the box, the local expansion the potential at those nodes; both are stored in the
+/// real parts of the coefficient vectors of the box. M2M and L2L are interpolations between the
+/// nodes of a box and its children, and M2L evaluates the kernel between the nodes of two boxes.
+/// All translations are precomputed per level, once for each relative position in an interaction list.
+class ChebyshevPotential : public Potential {
+
+public:
+
+	/// Interaction kernel
+	const Kernel& kernel;
+
+	/// Number of Chebyshev nodes per dimension
+	int nodes;
+
+	/// Constructor, the expansions have nodes^2 coefficients
+	ChebyshevPotential(const Kernel& kernel, const int nodes);
+
+	virtual bool IsAnalytic() const
+	{
+		return false;
+	}
+
+	virtual const Kernel* GetKernel() const
+	{
+		return &kernel;
+	}
+
+	/// Build the M2L operators of the levels not built yet
+	virtual void PrecomputeOperators(const int levels);
+
+	/// Append the M2L operators of the first levels levels, level by level and offset by offset
+	virtual void ExportOperators(const int levels, std::vector<double>& table) const;
+
+	virtual bool ImportOperators(const int levels, const double* table, const size_t size);
+
+	virtual double DirectEvaluate(const Complex& y, const Complex& x)
+	{
+		return kernel.Evaluate(norm(y - x));
+	}
+
+	virtual void EvaluateDirect(const double* tx, const double* ty, const int m,
+		const double* sx, const double* sy, const double* sq, const int n, double* potentials, const Complex& shift = Complex(0, 0));
+
+	virtual void EvaluateDirectMutual(const double* x1, const double* y1, const double* q1, const int n1, double* potentials1,
+		const double* x2, const double* y2, const double* q2, const int n2, double* potentials2, const Complex& shift = Complex(0, 0));
+
+	virtual void EvaluateDirectSelf(const double* x, const double* y, const double* q, const int n, double* potentials);
+
+	virtual void BoxMultipoleExpansion(Box* box);
+
+	virtual void BoxMultipoleToMultipole(const Box* child, Box* parent);
+
+	virtual void BoxMultipoleToLocal(const Box* source, Box* target, const Complex& shift);
+
+	virtual void BoxLocalToLocal(const Box* parent, Box* child);
+
+	using Potential::BoxLocalExpansion;
+
+	virtual void BoxLocalExpansion(const Box* box, const double* x, const double* y, const int n, double* potentials);
+
+private:
+
+	/// Chebyshev nodes on [-1, 1]
+	std::vector<double> roots;
+
+	/// Chebyshev polynomials at the nodes, T_k(roots[a]) at a * nodes + k
+	std::vector<double> polynomials;
+
+	/// Interpolation weights from the nodes of a box to the nodes of its lower (0) and upper (1)
+	/// half in one dimension, the weight of box node a at child node b is at a * nodes + b
+	std::vector<double> childWeights[2];
+
+	/// M2L operators of each level, one nodes^2 x nodes^2 matrix per relative position of the
+	/// source box in [-3, 3]^2, empty for the positions of neighbors
+	std::vector<std::vector<std::vector<double>>> m2l;
+
+	/// Interpolation weights of the nodes at a point u in [-1, 1] of one dimension
+	void Weights(const double u, double* weights) const;
+
+	/// Relative position of a source box to a target box of the same level as an index into m2l
+	static inline int Offset(const Complex& source, const Complex& target, const double size)
+	{
+		int dx = (int)lround(real(source - target) / size);
+		int dy = (int)lround(imag(source - target) / size);
+		return (dx + 3) * 7 + (dy + 3);
+	}
+
+};
+
+#endif
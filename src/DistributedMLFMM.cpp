@@ -0,0 +1,227 @@
+#include <cstdio>
+#include "DistributedMLFMM.h"
+
+DistributedMLFMM::DistributedMLFMM(MPI_Comm comm, const int levels, Potential& potential)
+: DistributedMLFMM(comm, levels, potential, std::vector<int>(levels, potential.degree))
+{
+
+}
+
+DistributedMLFMM::DistributedMLFMM(MPI_Comm comm, const int levels, Potential& potential, const std::vector<int>& degrees)
+: comm(comm), tree(levels, potential, degrees, 0, 0)
+{
+	MPI_Comm_rank(comm, &rank);
+	MPI_Comm_size(comm, &size);
+}
+
+void DistributedMLFMM::AddParticle(const Complex& coord, const int index, const double charge)
+{
+	input.push_back(Point(coord, index, charge));
+}
+
+void DistributedMLFMM::AddParticles(const ParticleFile& file, const size_t begin, const size_t end)
+{
+	input.reserve(input.size() + end - begin);
+	for (size_t start = begin; start < end; start += ParticleFile::DefaultChunk) {
+		size_t stop = std::min(start + ParticleFile::DefaultChunk, end);
+		file.Prefetch(stop, std::min(stop + ParticleFile::DefaultChunk, end));
+		for (size_t i = start; i < stop; i++)
+			input.push_back(Point(Complex(file.x[i], file.y[i]), (int)i, file.Charge(i)));
+		file.Release(start, stop);
+	}
+}
+
+int DistributedMLFMM::Owner(const int leaf)
+{
+	// ranks with an empty range share their first leaf with the next rank; the last of them owns it
+	return std::upper_bound(leafBegin.begin(), leafBegin.end(), leaf) - leafBegin.begin() - 1;
+}
+
+void DistributedMLFMM::Partition()
+{
+	INSTRUMENT_PHASE(PhaseBuild);
+	const int maxLevel = tree.maxLevel;
+	const int leaves = tree.structure[maxLevel].size();
+
+	// global number of particles per leaf
+	std::vector<long> counts(leaves, 0);
+	for (auto &point : input)
+		counts[tree.GetBoxIndex(point.coord, maxLevel)]++;
+	MPI_Allreduce(MPI_IN_PLACE, counts.data(), leaves, MPI_LONG, MPI_SUM, comm);
+
+	// split the Morton order of the leaves into ranges of about total / size particles
+	long total = 0;
+	for (auto &count : counts)
+		total += count;
+	leafBegin.assign(size + 1, leaves);
+	leafBegin[0] = 0;
+	long cumulative = 0;
+	int next = 1;
+	for (int leaf = 0; leaf < leaves; leaf++) {
+		while (next < size && cumulative >= total * next / size)
+			leafBegin[next++] = leaf;
+		cumulative += counts[leaf];
+	}
+
+	// send every particle to the owner of its leaf
+	std::vector<std::vector<double>> send(size);
+	for (auto &point : input)
+		Pack(send[Owner(tree.GetBoxIndex(point.coord, maxLevel))], point);
+	std::vector<Point>().swap(input);
+	std::vector<double> received = Exchange(send);
+	std::vector<std::vector<double>>().swap(send);
+
+	// only the boxes of the own leaves, their halo and their locally essential tree are allocated
+	tree.SetLeafRange(leafBegin[rank], leafBegin[rank + 1]);
+	particles.reserve(received.size() / 4);
+	for (size_t i = 0; i < received.size(); i += 4) {
+		particles.push_back(Point(Complex(received[i], received[i + 1]), (int)received[i + 3], received[i + 2]));
+		tree.AddSource(&particles.back());
+		tree.AddTarget(&particles.back());
+	}
+	ExchangeHalo();
+}
+
+void DistributedMLFMM::ExchangeHalo()
+{
+	const int maxLevel = tree.maxLevel;
+	std::vector<std::vector<double>> send(size);
+	std::vector<int> sentLeaf(size, -1);
+	for (int leaf = tree.leafBegin; leaf < tree.leafEnd; leaf++) {
+		Box* box = tree.structure[maxLevel][leaf];
+		if (box->sources.empty())
+			continue;
+		for (auto &neighbor : tree.GetNeighbors(box)) {
+			int owner = Owner(neighbor->index);
+			if (owner == rank || sentLeaf[owner] == leaf)
+				continue;
+			sentLeaf[owner] = leaf;
+			for (auto &source : box->sources)
+				Pack(send[owner], *source);
+		}
+	}
+	std::vector<double> received = Exchange(send);
+
+	// halo leaves lie outside the active range, so their sources only enter the near field
+	halo.reserve(received.size() / 4);
+	for (size_t i = 0; i < received.size(); i += 4) {
+		halo.push_back(Point(Complex(received[i], received[i + 1]), (int)received[i + 3], received[i + 2]));
+		tree.AddSource(&halo.back());
+	}
+}
+
+void DistributedMLFMM::ExchangeMultipoles()
+{
+	const int maxLevel = tree.maxLevel;
+	std::vector<std::vector<double>> send(size);
+	std::vector<long> sentBox(size, -1);
+	for (int level = 2; level <= maxLevel; level++) {
+		const int shift = 2 * (maxLevel - level);
+		for (int index = tree.ActiveBegin(level); index < tree.ActiveEnd(level); index++) {
+			Box* box = tree.structure[level][index];
+			const ComplexVec& coeffs = box->externalMultipoleCoeffs;
+			if (std::all_of(coeffs.begin(), coeffs.end(), [](const Complex& c) { return c == Complex(0, 0); }))
+				continue;
+			// the interaction list is symmetric: every rank owning a leaf of a box in it needs this partial expansion
+			long id = ((long)level << 32) | index;
+			for (auto &other : tree.GetInteractionList(box)) {
+				int first = Owner(other->index << shift);
+				int last = Owner(((other->index + 1) << shift) - 1);
+				for (int r = first; r <= last; r++) {
+					if (r == rank || sentBox[r] == id || leafBegin[r] == leafBegin[r + 1])
+						continue;
+					sentBox[r] = id;
+					send[r].push_back(level);
+					send[r].push_back(index);
+					for (auto &coeff : coeffs) {
+						send[r].push_back(real(coeff));
+						send[r].push_back(imag(coeff));
+					}
+				}
+			}
+		}
+	}
+	std::vector<double> received = Exchange(send);
+
+	// partial expansions of all ranks add up to the expansion of the whole box
+	for (size_t i = 0; i < received.size(); ) {
+		int level = (int)received[i];
+		int index = (int)received[i + 1];
+		i += 2;
+		for (auto &coeff : tree.structure[level][index]->externalMultipoleCoeffs) {
+			coeff += Complex(received[i], received[i + 1]);
+			i += 2;
+		}
+	}
+}
+
+bool DistributedMLFMM::Solve()
+{
+	if (tree.periodic) {
+		// the lattice operator would need the root expansion of all ranks
+		fprintf(stderr, "DistributedMLFMM does not support periodic mode\n");
+		return false;
+	}
+	tree.ClearExpansions();
+	tree.MultipoleExpansion();
+	tree.MultipoleToMultipoleTranslation();
+	ExchangeMultipoles();
+	tree.MultipoleToLocalTranslation();
+	tree.LocalToLocalTranslation();
+	tree.LocalExpansion();
+	tree.NearFieldInteraction();
+	return true;
+}
+
+void DistributedMLFMM::Gather(std::vector<double>& potentials, const int root)
+{
+	std::vector<double> local;
+	local.reserve(2 * particles.size());
+	for (auto &particle : particles) {
+		local.push_back(particle.index);
+		local.push_back(particle.potential);
+	}
+	int count = local.size();
+	std::vector<int> counts(size), displacements(size, 0);
+	MPI_Gather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, root, comm);
+	for (int r = 1; r < size; r++)
+		displacements[r] = displacements[r - 1] + counts[r - 1];
+	std::vector<double> all(rank == root ? displacements[size - 1] + counts[size - 1] : 0);
+	MPI_Gatherv(local.data(), count, MPI_DOUBLE, all.data(), counts.data(), displacements.data(), MPI_DOUBLE, root, comm);
+	if (rank != root)
+		return;
+	potentials.assign(all.size() / 2, 0.0);
+	for (size_t i = 0; i < all.size(); i += 2) {
+		size_t index = (size_t)all[i];
+		if (index >= potentials.size())
+			potentials.resize(index + 1, 0.0);
+		potentials[index] = all[i + 1];
+	}
+}
+
+long DistributedMLFMM::TotalFlops()
+{
+	long total = 0;
+	MPI_Allreduce(&tree.flops, &total, 1, MPI_LONG, MPI_SUM, comm);
+	return total;
+}
+
+std::vector<double> DistributedMLFMM::Exchange(const std::vector<std::vector<double>>& send)
+{
+	std::vector<int> sendCounts(size), sendDisplacements(size, 0), receiveCounts(size), receiveDisplacements(size, 0);
+	for (int r = 0; r < size; r++)
+		sendCounts[r] = send[r].size();
+	MPI_Alltoall(sendCounts.data(), 1, MPI_INT, receiveCounts.data(), 1, MPI_INT, comm);
+	for (int r = 1; r < size; r++) {
+		sendDisplacements[r] = sendDisplacements[r - 1] + sendCounts[r - 1];
+		receiveDisplacements[r] = receiveDisplacements[r - 1] + receiveCounts[r - 1];
+	}
+	std::vector<double> buffer;
+	buffer.reserve(sendDisplacements[size - 1] + sendCounts[size - 1]);
+	for (auto &values : send)
+		buffer.insert(buffer.end(), values.begin(), values.end());
+	std::vector<double> received(receiveDisplacements[size - 1] + receiveCounts[size - 1]);
+	MPI_Alltoallv(buffer.data(), sendCounts.data(), sendDisplacements.data(), MPI_DOUBLE,
+		received.data(), receiveCounts.data(), receiveDisplacements.data(), MPI_DOUBLE, comm);
+	return received;
+}
@@ -0,0 +1,87 @@
+#ifndef DistributedMLFMM_h
+#define DistributedMLFMM_h
+
+#include <mpi.h>
+#include "MLFMM.h"
+#include "ParticleIO.h"
+
+/// Distributed-memory MLFMM over the ranks of an MPI communicator.
+/// Particles are partitioned into contiguous ranges of leaves in Morton order with about equal
+/// particle counts. Every rank evaluates the targets of its own leaves in a local MLFMM whose
+/// passes are restricted to that range. It receives halo sources of the neighboring leaves owned
+/// by other ranks, and the partial multipole expansions of the boxes in the interaction lists of
+/// its boxes (the locally essential tree). Only those boxes are allocated, so the expansions and
+/// particles of a rank scale with N / P; what every rank holds in full is a pointer per box of
+/// the tree and, while partitioning, a particle count per leaf.
+class DistributedMLFMM {
+
+public:
+
+	/// Communicator of the participating ranks
+	MPI_Comm comm;
+	/// Index of this rank and number of ranks in the communicator
+	int rank, size;
+
+	/// Local tree, evaluating the leaves of this rank
+	MLFMM tree;
+
+	/// First leaf index of each rank, with size + 1 entries
+	std::vector<int> leafBegin;
+
+	/// Particles added to this rank before partitioning
+	std::vector<Point> input;
+	/// Particles owned by this rank after partitioning, sources and targets of the local tree
+	std::vector<Point> particles;
+	/// Sources of neighboring leaves owned by other ranks
+	std::vector<Point> halo;
+
+	/// Constructor
+	DistributedMLFMM(MPI_Comm comm, const int levels, Potential& potential);
+
+	/// Constructor with a truncation number per level
+	DistributedMLFMM(MPI_Comm comm, const int levels, Potential& potential, const std::vector<int>& degrees);
+
+	/// Add a particle with a global index; any rank may add any particle before Partition
+	void AddParticle(const Complex& coord, const int index, const double charge = 1.0);
+
+	/// Add the particles [begin, end) of a mapped file, indexed by file row
+	void AddParticles(const ParticleFile& file, const size_t begin, const size_t end);
+
+	/// Partition the particles of all ranks by Morton order and exchange halo sources (collective)
+	void Partition();
+
+	/// Solve using the Fast Multipole Method (collective). Returns false on every rank if the
+	/// tree is periodic, which is not supported.
+	bool Solve();
+
+	/// Collect the potentials of all particles on a root rank, indexed by global index (collective)
+	void Gather(std::vector<double>& potentials, const int root);
+
+	/// Sum of the FLOP counters of all ranks (collective)
+	long TotalFlops();
+
+	/// Rank that owns a leaf
+	int Owner(const int leaf);
+
+private:
+
+	/// Append a particle to a message as x, y, charge and index
+	static inline void Pack(std::vector<double>& message, const Point& point)
+	{
+		message.push_back(real(point.coord));
+		message.push_back(imag(point.coord));
+		message.push_back(point.charge);
+		message.push_back(point.index);
+	}
+
+	/// Send halo sources to the ranks that own neighboring leaves
+	void ExchangeHalo();
+
+	/// Send partial multipole expansions to the ranks whose boxes have them in their interaction lists
+	void ExchangeMultipoles();
+
+	/// Send doubles to other ranks; send[r] holds the values for rank r, returns those received in rank order
+	std::vector<double> Exchange(const std::vector<std::vector<double>>& send);
+};
+
+#endif
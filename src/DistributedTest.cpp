@@ -0,0 +1,114 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <algorithm>
+#include "DistributedMLFMM.h"
+#include "Distributions.h"
+
+// Run with e.g. mpirun -np 4 bin/DistributedTest --n 100000 --dist plummer
+// Rank 0 checks the distributed potentials against a single-process Solve() of the same particles.
+
+int main(int argc, char** argv)
+{
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    int N = 100000, levels = 0, degree = 10;
+    std::string distribution = "uniform", input;
+    bool check = true;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string key = argv[i];
+        if      (key == "--n")      N = atoi(argv[i + 1]);
+        else if (key == "--levels") levels = atoi(argv[i + 1]);
+        else if (key == "--degree") degree = atoi(argv[i + 1]);
+        else if (key == "--dist")   distribution = argv[i + 1];
+        else if (key == "--input")  input = argv[i + 1];
+        else if (key == "--check")  check = (std::string(argv[i + 1]) == "on");
+    }
+
+    // every rank starts with an arbitrary slice of the particles, here consecutive rows
+    ParticleFile file;
+    Coordinates coords;
+    if (!input.empty()) {
+        if (!file.Open(input))
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        N = file.count;
+    } else {
+        coords = GenerateDistribution(distribution, N, 1);
+        if (coords.empty())
+            MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (levels <= 0)
+        levels = std::max(3, (int)round(log((double)N) / log(4.0)));
+    size_t begin = (size_t)N * rank / size, end = (size_t)N * (rank + 1) / size;
+
+    Potential coulomb(degree);
+    DistributedMLFMM fmm(MPI_COMM_WORLD, levels, coulomb);
+    if (!input.empty())
+        fmm.AddParticles(file, begin, end);
+    else
+        for (size_t i = begin; i < end; i++)
+            fmm.AddParticle(coords[i], i, (i % 2) ? 1.0 : -1.0);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+    fmm.Partition();
+    MPI_Barrier(MPI_COMM_WORLD);
+    double partitionTime = MPI_Wtime() - start;
+    start = MPI_Wtime();
+    if (!fmm.Solve())
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    MPI_Barrier(MPI_COMM_WORLD);
+    double solveTime = MPI_Wtime() - start;
+    long flops = fmm.TotalFlops();
+
+    int owned = fmm.particles.size(), halo = fmm.halo.size(), boxes = 0;
+    for (auto &level : fmm.tree.structure)
+        boxes += std::count_if(level.begin(), level.end(), [](const Box* box) { return box != NULL; });
+    std::vector<int> owners(size), halos(size), allocated(size);
+    MPI_Gather(&owned, 1, MPI_INT, owners.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Gather(&halo, 1, MPI_INT, halos.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Gather(&boxes, 1, MPI_INT, allocated.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    std::vector<double> potentials;
+    fmm.Gather(potentials, 0);
+
+    if (rank == 0) {
+        printf("# ranks=%d N=%d levels=%d degree=%d\n", size, N, levels, degree);
+        printf("%6s %10s %10s %10s %10s %10s\n", "rank", "leaves", "particles", "halo", "first", "boxes");
+        for (int r = 0; r < size; r++)
+            printf("%6d %10d %10d %10d %10d %10d\n", r, fmm.leafBegin[r + 1] - fmm.leafBegin[r], owners[r], halos[r], fmm.leafBegin[r], allocated[r]);
+        printf("%20s %10.3f s\n", "partition time", partitionTime);
+        printf("%20s %10.3f s\n", "solve time", solveTime);
+        printf("%20s %10ld\n", "flops", flops);
+
+        if (check) {
+            // the same particles in one address space
+            std::vector<Point> points;
+            points.reserve(N);
+            MLFMM tree(levels, coulomb);
+            for (int i = 0; i < N; i++) {
+                if (!input.empty())
+                    points.push_back(Point(Complex(file.x[i], file.y[i]), i, file.Charge(i)));
+                else
+                    points.push_back(Point(coords[i], i, (i % 2) ? 1.0 : -1.0));
+                tree.AddSource(&points.back());
+                tree.AddTarget(&points.back());
+            }
+            start = MPI_Wtime();
+            tree.Solve();
+            double serialTime = MPI_Wtime() - start;
+            double difference = 0, scale = 0;
+            for (int i = 0; i < N; i++) {
+                difference = std::max(difference, fabs(potentials[i] - points[i].potential));
+                scale = std::max(scale, fabs(points[i].potential));
+            }
+            printf("%20s %10.3f s\n", "single-process time", serialTime);
+            printf("%20s %10.2e\n", "max rel difference", difference / scale);
+        }
+    }
+    MPI_Finalize();
+    return 0;
+}
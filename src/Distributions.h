@@ -0,0 +1,77 @@
+#ifndef Distributions_h
+#define Distributions_h
+
+#include <string>
+#include "GeneralUtilities.h"
+
+/// Particle coordinates in the unit square [0, 1) x [0, 1)
+typedef std::vector<Complex> Coordinates;
+
+/// Largest coordinate strictly inside the unit square
+const double UnitSquareMax = 1.0 - 1.0e-12;
+
+/// Clamp a coordinate into the unit square
+inline Complex ClampToUnitSquare(const Complex& coord) {
+	return Complex(std::min(std::max(real(coord), 0.0), UnitSquareMax),
+	               std::min(std::max(imag(coord), 0.0), UnitSquareMax));
+}
+
+/// Uniformly distributed particles
+inline Coordinates UniformDistribution(const int N, std::mt19937& rng) {
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	Coordinates coords(N);
+	for (int i = 0; i < N; i++)
+		coords[i] = Complex(uniform(rng), uniform(rng));
+	return coords;
+}
+
+/// Plummer-like cluster centered in the unit square with a given core radius
+inline Coordinates PlummerDistribution(const int N, std::mt19937& rng, const double radius = 0.02) {
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	Coordinates coords(N);
+	for (int i = 0; i < N; i++) {
+		// inverse of the 2D Plummer cumulative mass m(r) = r^2 / (r^2 + a^2), resampled outside the square
+		Complex coord;
+		do {
+			double m = uniform(rng);
+			double r = radius * sqrt(m / (1.0 - m));
+			coord = Complex(0.5, 0.5) + std::polar(r, 2.0 * M_PI * uniform(rng));
+		} while (real(coord) < 0 || imag(coord) < 0 || real(coord) > UnitSquareMax || imag(coord) > UnitSquareMax);
+		coords[i] = coord;
+	}
+	return coords;
+}
+
+/// Particles along the diagonal of the unit square with a small transverse jitter
+inline Coordinates LineDistribution(const int N, std::mt19937& rng, const double width = 1.0e-3) {
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	std::normal_distribution<double> jitter(0.0, width);
+	Coordinates coords(N);
+	for (int i = 0; i < N; i++) {
+		double t = uniform(rng);
+		coords[i] = ClampToUnitSquare(Complex(t + jitter(rng), t + jitter(rng)));
+	}
+	return coords;
+}
+
+/// Particles on a ring of radius 0.4 around the center of the unit square with a small radial jitter
+inline Coordinates RingDistribution(const int N, std::mt19937& rng, const double width = 1.0e-3) {
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	std::normal_distribution<double> jitter(0.0, width);
+	Coordinates coords(N);
+	for (int i = 0; i < N; i++)
+		coords[i] = ClampToUnitSquare(Complex(0.5, 0.5) + std::polar(0.4 + jitter(rng), 2.0 * M_PI * uniform(rng)));
+	return coords;
+}
+
+/// Generate a named distribution: uniform, plummer, line or ring; returns an empty set for unknown names
+inline Coordinates GenerateDistribution(const std::string& name, const int N, const unsigned seed) {
+	std::mt19937 rng(seed);
+	if (name == "uniform") return UniformDistribution(N, rng);
+	if (name == "plummer") return PlummerDistribution(N, rng);
+	if (name == "line")    return LineDistribution(N, rng);
+	if (name == "ring")    return RingDistribution(N, rng);
+	return Coordinates();
+}
+
+#endif
@@ -33,6 +33,14 @@ public:
 	/// Collection of targets inside this box
 	std::vector<Point*> targets;
 
+	/// Source coordinates and charges in structure-of-arrays layout, in the order of sources
+	std::vector<double> sourceX, sourceY, sourceQ;
+	/// Target coordinates in structure-of-arrays layout, in the order of targets
+	std::vector<double> targetX, targetY;
+
+	/// Potentials of the targets accumulated by L2P and P2P, in the order of targets
+	std::vector<double> targetPotential;
+
 
 	/// Constructor
 	Box(const int level, const int index, const int degree) 
@@ -66,12 +74,51 @@ public:
 	inline void AddSource(Point* source) 
 	{
 		sources.push_back(source);
+		sourceX.push_back(real(source->coord));
+		sourceY.push_back(imag(source->coord));
+		sourceQ.push_back(source->charge);
+	}
+
+	/// Check if the sources and the targets are the same points in the same order
+	inline bool IsCoincident() const
+	{
+		return sources == targets;
+	}
+
+	/// Reserve room for a number of additional sources and targets
+	inline void Reserve(const int moreSources, const int moreTargets)
+	{
+		sources.reserve(sources.size() + moreSources);
+		sourceX.reserve(sourceX.size() + moreSources);
+		sourceY.reserve(sourceY.size() + moreSources);
+		sourceQ.reserve(sourceQ.size() + moreSources);
+		targets.reserve(targets.size() + moreTargets);
+		targetX.reserve(targetX.size() + moreTargets);
+		targetY.reserve(targetY.size() + moreTargets);
+	}
+
+	/// Reallocate the arrays of this box in the calling thread, which places them on its NUMA node by first touch
+	inline void Rehome()
+	{
+		std::vector<Point*>(sources).swap(sources);
+		std::vector<Point*>(targets).swap(targets);
+		std::vector<double>(sourceX).swap(sourceX);
+		std::vector<double>(sourceY).swap(sourceY);
+		std::vector<double>(sourceQ).swap(sourceQ);
+		std::vector<double>(targetX).swap(targetX);
+		std::vector<double>(targetY).swap(targetY);
+		std::vector<double>(targetPotential).swap(targetPotential);
+		ComplexVec(externalMultipoleCoeffs).swap(externalMultipoleCoeffs);
+		ComplexVec(localMultipoleCoeffs).swap(localMultipoleCoeffs);
+		ComplexVec(localMultipoleCoeffsTilde).swap(localMultipoleCoeffsTilde);
 	}
 
 	/// Add a target point to this box
 	inline void AddTarget(Point* target)
 	{
 		targets.push_back(target);
+		targetX.push_back(real(target->coord));
+		targetY.push_back(imag(target->coord));
 	}
 
 };
@@ -2,7 +2,12 @@
 #define Potential_h
 
 #include "FMMBox.h"
+#include "Instrumentation.h"
 
+class Kernel;
+
+/// Analytic expansions of the 2D Coulomb potential log(r). The methods called by the MLFMM passes
+/// are virtual, so that ChebyshevPotential can replace them for other kernels.
 class Potential {
 
 public:
@@ -16,72 +21,457 @@ public:
 
 	}
 
+	/// Destructor
+	virtual ~Potential()
+	{
+
+	}
+
+	/// Whether the expansions are the analytic ones of this class, required by periodic mode and variable degrees
+	virtual bool IsAnalytic() const
+	{
+		return true;
+	}
+
+	/// Kernel of kernel-independent expansions, null for the analytic ones
+	virtual const Kernel* GetKernel() const
+	{
+		return 0;
+	}
+
+	/// Prepare translation operators for the levels of a tree; the analytic ones are built on the fly
+	virtual void PrecomputeOperators(const int levels)
+	{
+
+	}
+
+	/// Append the precomputed translation operators of the first levels levels to a table, for snapshots
+	virtual void ExportOperators(const int levels, std::vector<double>& table) const
+	{
+
+	}
+
+	/// Take the precomputed translation operators of levels levels from a table written by
+	/// ExportOperators, returns false if the table does not fit
+	virtual bool ImportOperators(const int levels, const double* table, const size_t size)
+	{
+		return size == 0;
+	}
+
+	/// Estimated relative truncation error of an expansion with a given number of terms
+	static inline double TruncationError(const int degree)
+	{
+		// empirical convergence ratio of the M2L translation for the 3x3 neighbor stencil
+		return pow(3.0, -degree);
+	}
+
+	/// Smallest number of terms whose estimated truncation error is below a tolerance
+	static inline int DegreeForTolerance(const double tolerance)
+	{
+		int degree = 2;
+		while (TruncationError(degree) > tolerance)
+			degree++;
+		return degree;
+	}
+
+	/// Number of particles processed together by the batched P2M and L2P kernels
+	static const int Batch = 64;
+
+	/// Operation counts of the P2M expansion of one particle into degree coefficients
+	static inline KernelCost P2MCost(const int degree)
+	{
+		// per term a running complex multiplication and a complex sum, on batch arrays in L1
+		return { 5 + 8 * (degree - 1), 0, 24 + 48 * (degree - 1) };
+	}
+
+	/// Operation counts of the L2P evaluation of degree coefficients at one particle
+	static inline KernelCost L2PCost(const int degree)
+	{
+		// per term one complex multiply-add of Horner's scheme, on batch arrays in L1
+		return { 8 * (degree - 1), 0, 24 + 32 * (degree - 1) };
+	}
+
+	/// Operation counts of one P2P pair interaction
+	static inline KernelCost P2PCost()
+	{
+		// difference, squared distance, log, halving, charge and accumulation
+		return { 8, 1, 24 };
+	}
+
+	/// Operation counts of one symmetric P2P pair interaction, updating both particles
+	static inline KernelCost P2PSymmetricCost()
+	{
+		// one log shared by both sides, each side loads and accumulates its own potential
+		return { 10, 1, 40 };
+	}
+
+	/// Operation counts of one M2L translation
+	static inline KernelCost M2LCost(const int inDegree, const int outDegree)
+	{
+		// complex division counted as 11 flops; matrix build, then matrix-vector product
+		long size = std::max(inDegree, outDegree);
+		long build = 11 + 15 * (size - 2) + 11 * (size - 1) + 15 * (size - 1) * (size - 1);
+		return { build + 8 * inDegree * outDegree, size, 16 * (size * size + inDegree * outDegree + inDegree + 3 * outDegree) };
+	}
+
+	/// Operation counts of one M2M translation
+	static inline KernelCost M2MCost(const int inDegree, const int outDegree)
+	{
+		long size = std::max(inDegree, outDegree);
+		long build = 10 * (size - 2) + 5 * (size - 1) * (size - 2);
+		return { build + 8 * inDegree * outDegree, 0, 16 * (size * size + inDegree * outDegree + inDegree + 3 * outDegree) };
+	}
+
+	/// Operation counts of one L2L translation
+	static inline KernelCost L2LCost(const int inDegree, const int outDegree)
+	{
+		long size = std::max(inDegree, outDegree);
+		long build = 6 * (size - 1) + 15 * (size - 1) * (size - 2) / 2;
+		return { build + 8 * inDegree * outDegree, 0, 16 * (size * size + inDegree * outDegree + inDegree + 3 * outDegree) };
+	}
+
 	/// Directly evaluate the potential
-	inline double DirectEvaluate(const Complex& y, const Complex& x) 
+	virtual double DirectEvaluate(const Complex& y, const Complex& x) 
 	{
 		return real(log(y - x));
 	}
 
+	/// Potential of a pair at squared distance r2, zero for coincident points
+	static inline double PairPotential(const double r2)
+	{
+		// real(log(z)) = log|z| = 0.5 log|z|^2, which avoids the atan2 of the complex log
+		return (r2 > 0) ? 0.5 * log(r2) : 0.0;
+	}
+
+	/// Add the potentials of n sources with coordinates (sx, sy) + shift and charges sq at m targets
+	/// with coordinates (tx, ty) to potentials, skipping coincident pairs
+	virtual void EvaluateDirect(const double* tx, const double* ty, const int m,
+		const double* sx, const double* sy, const double* sq, const int n, double* potentials, const Complex& shift = Complex(0, 0))
+	{
+		const double shiftX = real(shift), shiftY = imag(shift);
+		for (int i = 0; i < m; i++) {
+			const double x = tx[i] - shiftX, y = ty[i] - shiftY;
+			double sum = 0;
+			#pragma omp simd reduction(+:sum)
+			for (int j = 0; j < n; j++) {
+				double dx = x - sx[j], dy = y - sy[j];
+				sum += sq[j] * PairPotential(dx * dx + dy * dy);
+			}
+			potentials[i] += sum;
+		}
+	}
+
+	/// Add the mutual potentials of two disjoint groups of particles that are both sources and
+	/// targets, the second one displaced by shift, evaluating each pair once for both sides
+	virtual void EvaluateDirectMutual(const double* x1, const double* y1, const double* q1, const int n1, double* potentials1,
+		const double* x2, const double* y2, const double* q2, const int n2, double* potentials2, const Complex& shift = Complex(0, 0))
+	{
+		const double shiftX = real(shift), shiftY = imag(shift);
+		for (int i = 0; i < n1; i++) {
+			const double x = x1[i] - shiftX, y = y1[i] - shiftY;
+			double sum = 0;
+			#pragma omp simd reduction(+:sum)
+			for (int j = 0; j < n2; j++) {
+				double dx = x - x2[j], dy = y - y2[j];
+				double g = PairPotential(dx * dx + dy * dy);
+				sum += q2[j] * g;
+				potentials2[j] += q1[i] * g;
+			}
+			potentials1[i] += sum;
+		}
+	}
+
+	/// Add the mutual potentials of n particles that are both sources and targets, evaluating each pair once
+	virtual void EvaluateDirectSelf(const double* x, const double* y, const double* q, const int n, double* potentials)
+	{
+		for (int i = 0; i + 1 < n; i++)
+			Potential::EvaluateDirectMutual(x + i, y + i, q + i, 1, potentials + i,
+				x + i + 1, y + i + 1, q + i + 1, n - i - 1, potentials + i + 1);
+	}
+
+	/// P2M of the sources of a leaf into its multipole expansion
+	virtual void BoxMultipoleExpansion(Box* box)
+	{
+		MultipoleExpansion(box->sourceX.data(), box->sourceY.data(), box->sourceQ.data(), box->sources.size(), box->center, box->externalMultipoleCoeffs);
+	}
+
+	/// M2M of the multipole expansion of a child into that of its parent
+	virtual void BoxMultipoleToMultipole(const Box* child, Box* parent)
+	{
+		parent->externalMultipoleCoeffs += MultipoleToMultipole(child->center, parent->center, child->externalMultipoleCoeffs, parent->degree);
+	}
+
+	/// M2L of the multipole expansion of a source box, displaced by shift, into the temporary local expansion of a target box
+	virtual void BoxMultipoleToLocal(const Box* source, Box* target, const Complex& shift)
+	{
+		target->localMultipoleCoeffsTilde += MultipoleToLocal(source->center + shift, target->center, source->externalMultipoleCoeffs, target->degree);
+	}
+
+	/// L2L of the local expansion of a parent into that of its child
+	virtual void BoxLocalToLocal(const Box* parent, Box* child)
+	{
+		child->localMultipoleCoeffs += LocalToLocal(parent->center, child->center, parent->localMultipoleCoeffs, child->degree);
+	}
+
+	/// L2P of the local expansion of a leaf, adding to the potentials of its targets
+	inline void BoxLocalExpansion(Box* box)
+	{
+		BoxLocalExpansion(box, box->targetX.data(), box->targetY.data(), box->targets.size(), box->targetPotential.data());
+	}
+
+	/// L2P of the local expansion of a box at n points with coordinates (x, y) inside it, adding to potentials
+	virtual void BoxLocalExpansion(const Box* box, const double* x, const double* y, const int n, double* potentials)
+	{
+		EvaluateLocal(x, y, n, box->center, box->localMultipoleCoeffs, potentials);
+	}
+
 	/// Matrix-vector multiplication between translation matrix and vector of expansion coefficients
 	inline ComplexVec ApplyTranslation(const ComplexMat& matrix, const ComplexVec& coeff) 
 	{
-		ComplexVec product(degree, Complex(0,0));
-		for (int i = 0; i < degree; i++)
-			for (int j = 0; j < degree; j++)
+		return ApplyTranslation(matrix, coeff, degree);
+	}
+
+	/// Matrix-vector multiplication keeping the first outDegree rows of the translation matrix
+	inline ComplexVec ApplyTranslation(const ComplexMat& matrix, const ComplexVec& coeff, const int outDegree) 
+	{
+		ComplexVec product(outDegree, Complex(0,0));
+		for (int i = 0; i < outDegree; i++)
+			for (int j = 0; j < coeff.size(); j++)
 				product[i] += coeff[j] * matrix[i][j];
 		return product;
 	}
 
 	/// Apply Multipole-to-Local translation
 	inline ComplexVec MultipoleToLocal(const Complex& from, const Complex& to, const ComplexVec& MultipoleCoeff) 
+	{
+		return MultipoleToLocal(from, to, MultipoleCoeff, degree);
+	}
+
+	/// Apply Multipole-to-Local translation, producing outDegree local coefficients
+	inline ComplexVec MultipoleToLocal(const Complex& from, const Complex& to, const ComplexVec& MultipoleCoeff, const int outDegree) 
 	{
 		Complex t = to - from;
-		ComplexMat M2L(degree, ComplexVec(degree, Complex(0,0)));
+		int size = std::max(outDegree, (int)MultipoleCoeff.size());
+		ComplexMat M2L(size, ComplexVec(size, Complex(0,0)));
 		M2L[0][0] = log(t);
-		M2L[1][0] = 1.0 / t;
-		for (int i = 2; i < degree; i++)
+		if (size > 1)
+			M2L[1][0] = 1.0 / t;
+		for (int i = 2; i < size; i++)
 			M2L[i][0] = -M2L[i-1][0] * (double)(i - 1) / (t * (double)i);
-		for (int j = 1; j < degree; j++)
+		for (int j = 1; j < size; j++)
 			M2L[0][j] = 1.0 / pow(t, j);
-		for (int i = 1; i < degree; i++)
-			for (int j = 1; j < degree; j++)
+		for (int i = 1; i < size; i++)
+			for (int j = 1; j < size; j++)
 				M2L[i][j] = M2L[i-1][j] * (double)(i + j - 1) / (-t * (double)i);
-		return ApplyTranslation(M2L, MultipoleCoeff);
+		return ApplyTranslation(M2L, MultipoleCoeff, outDegree);
 	}
 
 	/// Apply Multipole-to-Multipole translation
 	inline ComplexVec MultipoleToMultipole(const Complex& from, const Complex& to, const ComplexVec& MultipoleCoeff) 
+	{
+		return MultipoleToMultipole(from, to, MultipoleCoeff, degree);
+	}
+
+	/// Apply Multipole-to-Multipole translation, producing outDegree multipole coefficients
+	inline ComplexVec MultipoleToMultipole(const Complex& from, const Complex& to, const ComplexVec& MultipoleCoeff, const int outDegree) 
 	{
 		Complex t = to - from;
-		ComplexMat M2M(degree, ComplexVec(degree, Complex(0,0)));
-		for (int i = 0; i < degree; i++)
+		int size = std::max(outDegree, (int)MultipoleCoeff.size());
+		ComplexMat M2M(size, ComplexVec(size, Complex(0,0)));
+		for (int i = 0; i < size; i++)
 			M2M[i][i] = Complex(1, 0);
-		M2M[1][0] = t;
-		for (int i = 2; i < degree; i++)
+		if (size > 1)
+			M2M[1][0] = t;
+		for (int i = 2; i < size; i++)
 			M2M[i][0] = -M2M[i-1][0] * (double)(i-1) * t / (double)i;
-		for (int i = 1; i < degree; i++)
+		for (int i = 1; i < size; i++)
 			for (int j = i-1; j >= 1; j--)
 				M2M[i][j] = -M2M[i][j+1] * t * (double)j / (double)(i - j);
-		return ApplyTranslation(M2M, MultipoleCoeff);
+		return ApplyTranslation(M2M, MultipoleCoeff, outDegree);
 	}
 
 	/// Apply Local-to-Local translation
 	inline ComplexVec LocalToLocal(const Complex& from, const Complex& to, const ComplexVec& LocalCoeff) 
+	{
+		return LocalToLocal(from, to, LocalCoeff, degree);
+	}
+
+	/// Apply Local-to-Local translation, producing outDegree local coefficients
+	inline ComplexVec LocalToLocal(const Complex& from, const Complex& to, const ComplexVec& LocalCoeff, const int outDegree) 
 	{
 		Complex t = to - from;
-		ComplexMat L2L(degree, ComplexVec(degree, Complex(0,0)));
-		for (int i = 0; i < degree; i++)
+		int size = std::max(outDegree, (int)LocalCoeff.size());
+		ComplexMat L2L(size, ComplexVec(size, Complex(0,0)));
+		for (int i = 0; i < size; i++)
 			L2L[i][i] = Complex(1, 0);
-		for (int j = 1; j < degree; j++)
+		for (int j = 1; j < size; j++)
 			L2L[0][j] = L2L[0][j-1] * t;
-		for (int i = 1; i < degree; i++)
-			for (int j = i+1; j < degree; j++)
+		for (int i = 1; i < size; i++)
+			for (int j = i+1; j < size; j++)
 				L2L[i][j] = L2L[i-1][j] * (double)(j - i + 1) / (t * (double)i);
-		return ApplyTranslation(L2L, LocalCoeff);
+		return ApplyTranslation(L2L, LocalCoeff, outDegree);
+	}
+
+	/// Accumulate the multipole expansion about x_star of n particles with coordinates (x, y) and charges q into coeffs
+	inline void MultipoleExpansion(const double* x, const double* y, const double* q, const int n, const Complex& x_star, ComplexVec& coeffs)
+	{
+		// charge times powers of (x_i - x_star) by running multiplication, vectorized across a batch of particles
+		const int degree = coeffs.size();
+		double zr[Batch], zi[Batch], pr[Batch], pi[Batch];
+		for (int start = 0; start < n; start += Batch) {
+			const int m = std::min(Batch, n - start);
+			double total = 0;
+			#pragma omp simd reduction(+:total)
+			for (int i = 0; i < m; i++) {
+				zr[i] = x[start + i] - real(x_star);
+				zi[i] = y[start + i] - imag(x_star);
+				pr[i] = q[start + i] * zr[i];
+				pi[i] = q[start + i] * zi[i];
+				total += q[start + i];
+			}
+			coeffs[0] += total;
+			for (int k = 1; k < degree; k++) {
+				double sr = 0, si = 0;
+				#pragma omp simd reduction(+:sr,si)
+				for (int i = 0; i < m; i++) {
+					sr += pr[i];
+					si += pi[i];
+				}
+				coeffs[k] -= Complex(sr, si) / (double)k;
+				#pragma omp simd
+				for (int i = 0; i < m; i++) {
+					double r = pr[i] * zr[i] - pi[i] * zi[i];
+					pi[i] = pr[i] * zi[i] + pi[i] * zr[i];
+					pr[i] = r;
+				}
+			}
+		}
+	}
+
+	/// Evaluate the local expansion coeffs about x_star at n particles with coordinates (x, y), adding to potentials
+	inline void EvaluateLocal(const double* x, const double* y, const int n, const Complex& x_star, const ComplexVec& coeffs, double* potentials)
+	{
+		// Horner's scheme, vectorized across a batch of particles
+		const int degree = coeffs.size();
+		double zr[Batch], zi[Batch], ar[Batch], ai[Batch];
+		for (int start = 0; start < n; start += Batch) {
+			const int m = std::min(Batch, n - start);
+			#pragma omp simd
+			for (int i = 0; i < m; i++) {
+				zr[i] = x[start + i] - real(x_star);
+				zi[i] = y[start + i] - imag(x_star);
+				ar[i] = real(coeffs[degree - 1]);
+				ai[i] = imag(coeffs[degree - 1]);
+			}
+			for (int k = degree - 2; k >= 0; k--) {
+				const double cr = real(coeffs[k]), ci = imag(coeffs[k]);
+				#pragma omp simd
+				for (int i = 0; i < m; i++) {
+					double r = ar[i] * zr[i] - ai[i] * zi[i] + cr;
+					ai[i] = ar[i] * zi[i] + ai[i] * zr[i] + ci;
+					ar[i] = r;
+				}
+			}
+			#pragma omp simd
+			for (int i = 0; i < m; i++)
+				potentials[start + i] += ar[i];
+		}
+	}
+
+	/// Sum of s^-m over the periodic images s = a + ib of the unit square with max(|a|, |b|) >= 2,
+	/// summed over square shells. Only powers that are multiples of 4 survive that symmetric sum.
+	static inline double FarLatticeSum(const int m)
+	{
+		if (m < 4 || m % 4 != 0)
+			return 0.0;
+		// Eisenstein series of the square lattice, G_m(i) = 2 zeta(m) + 2 (2 pi)^m / (m-1)! sum_d d^(m-1) q^d / (1 - q^d)
+		// with q = exp(-2 pi), which converges much faster than the lattice sum itself
+		double zeta = 0;
+		for (int n = 1; n < 1000000; n++) {
+			double term = pow((double)n, -m);
+			zeta += term;
+			if (term < 1.0e-18 * zeta)
+				break;
+		}
+		double series = 0;
+		for (int d = 1; d < 10000; d++) {
+			double term = exp(log(2.0) + m * log(2.0 * M_PI) - lgamma(m) + (m - 1) * log((double)d) - 2.0 * M_PI * d)
+				/ (1.0 - exp(-2.0 * M_PI * d));
+			series += term;
+			if (d > m && term < 1.0e-18 * series)
+				break;
+		}
+		double sum = 2.0 * zeta + series;
+		for (int a = -1; a <= 1; a++)
+			for (int b = -1; b <= 1; b++)
+				if (a != 0 || b != 0)
+					sum -= real(pow(Complex(a, b), -m));
+		return sum;
+	}
+
+	/// Integral of w^-m over the plane outside the square [-a, a] x [-a, a]
+	static inline double OutsideSquareIntegral(const int m, const double a)
+	{
+		if (m < 4 || m % 4 != 0)
+			return 0.0;
+		// in polar coordinates, 8 / (m - 2) a^(2 - m) times the integral of cos(m t) cos(t)^(m - 2) over [0, pi / 4]
+		const int steps = 4096;
+		const double h = 0.25 * M_PI / steps;
+		double sum = 0;
+		for (int k = 0; k <= steps; k++) {
+			double weight = (k == 0 || k == steps) ? 1 : ((k % 2) ? 4 : 2);
+			sum += weight * cos(m * k * h) * pow(cos(k * h), m - 2);
+		}
+		return 8.0 / (m - 2) * pow(a, 2 - m) * sum * h / 3.0;
+	}
+
+	/// Potential at z of a uniform unit charge density on the rectangle [x0, x1] x [y0, y1]
+	static inline double RectanglePotential(const Complex& z, const double x0, const double x1, const double y0, const double y1)
+	{
+		// antiderivative of 0.5 log(u^2 + v^2) in u and v
+		auto F = [](const double u, const double v) {
+			double r2 = u * u + v * v;
+			return 0.5 * ((r2 > 0 ? u * v * log(r2) : 0.0) - 3.0 * u * v
+				+ (u != 0 ? u * u * atan(v / u) : 0.0) + (v != 0 ? v * v * atan(u / v) : 0.0));
+		};
+		double x = real(z), y = imag(z);
+		return F(x - x0, y - y0) - F(x - x1, y - y0) - F(x - x0, y - y1) + F(x - x1, y - y1);
+	}
+
+	/// Translation of the multipole expansion of the unit square into a local expansion about its
+	/// center from all periodic images s with max(|Re s|, |Im s|) >= 2. The divergent log term of
+	/// the net charge is omitted and the net charge of those images is compensated by a uniform
+	/// background outside the 3 x 3 block of images.
+	static inline ComplexMat PeriodicLatticeOperator(const int degree)
+	{
+		ComplexMat lattice(degree, ComplexVec(degree, Complex(0, 0)));
+		std::vector<double> far(2 * degree), background(2 * degree);
+		for (int m = 0; m < 2 * degree; m++) {
+			far[m] = FarLatticeSum(m);
+			background[m] = OutsideSquareIntegral(m, 1.5);
+		}
+		// M2L entries for t = -s are -1 / (i s^i) for the charge and (-1)^i C(i+j-1, i) / s^(i+j) otherwise
+		for (int i = 1; i < degree; i++)
+			lattice[i][0] = -(far[i] - background[i]) / i;
+		for (int j = 1; j < degree; j++) {
+			double binomial = 1;
+			for (int i = 0; i < degree; i++) {
+				if (i > 0)
+					binomial *= (double)(j - 1 + i) / i;
+				lattice[i][j] = ((i % 2) ? -binomial : binomial) * far[i + j];
+			}
+		}
+		return lattice;
 	}
 
 	/// Get local expansion coefficients
 	inline ComplexVec GetLocalCoeffs(const Complex& y, const Complex& x_star) 
+	{
+		return GetLocalCoeffs(y, x_star, degree);
+	}
+
+	/// Get the first degree local expansion coefficients
+	inline ComplexVec GetLocalCoeffs(const Complex& y, const Complex& x_star, const int degree) 
 	{
 		ComplexVec coeffs(degree, Complex(0,0));
 		for (int i = 0; i < degree; i++)
@@ -91,6 +481,12 @@ public:
 
 	/// Get multipole expansion coefficients
 	inline ComplexVec GetMultipoleCoeffs(const Complex& x_i, const Complex& x_star) 
+	{
+		return GetMultipoleCoeffs(x_i, x_star, degree);
+	}
+
+	/// Get the first degree multipole expansion coefficients
+	inline ComplexVec GetMultipoleCoeffs(const Complex& x_i, const Complex& x_star, const int degree) 
 	{
 		ComplexVec coeffs(degree, Complex(0,0));
 		coeffs[0] = Complex(1, 0);
@@ -2,11 +2,13 @@
 #define GeneralUtilities_h
 
 #include <cmath>
+#include <algorithm>
 #include <vector>
 #include <complex>
 
 #include <random>
 #include <ctime>
+#include <chrono>
 
 typedef std::complex<double> Complex;
 typedef std::vector<std::complex<double>> ComplexVec;
@@ -18,6 +20,23 @@ inline void operator+=(ComplexVec &v1, const ComplexVec& v2) {
 	}
 }
 
+/// Wall-clock stopwatch
+class Timer {
+
+public:
+
+	/// Start (or restart) the stopwatch
+	inline void Start() { start = std::chrono::steady_clock::now(); }
+
+	/// Seconds elapsed since Start()
+	inline double Elapsed() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); }
+
+private:
+
+	std::chrono::steady_clock::time_point start;
+
+};
+
 inline double randf() {
 	return (double)rand() / RAND_MAX;
 }
@@ -0,0 +1,213 @@
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include "Instrumentation.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+Instrumentation::ThreadCounters Instrumentation::threads[Instrumentation::MaxThreads];
+std::atomic<int> Instrumentation::slots(0);
+int Instrumentation::currentPhase = PhaseNone;
+bool Instrumentation::perfEnabled = false;
+
+static const char* phaseNames[PhaseCount] = {
+	"none", "build", "P2M", "M2M", "M2L", "L2L", "L2P", "P2P", "BH charge", "BH evaluate", "direct"
+};
+
+static const char* counterNames[CounterCount] = {
+	"P2M", "M2M", "M2L", "L2L", "L2P", "P2P pairs", "BH visits", "BH far field",
+	"flops", "transcendentals", "bytes", "allocations", "allocated bytes",
+	"cycles", "instructions", "cache misses"
+};
+
+const char* Instrumentation::PhaseName(const int phase)
+{
+	return phaseNames[phase];
+}
+
+const char* Instrumentation::CounterName(const int counter)
+{
+	return counterNames[counter];
+}
+
+long Instrumentation::Get(const InstrumentPhase phase, const InstrumentCounter counter)
+{
+	long total = 0;
+	for (int thread = 0; thread < MaxThreads; thread++)
+		total += threads[thread].values[phase][counter];
+	return total;
+}
+
+void Instrumentation::Reset()
+{
+	for (int thread = 0; thread < MaxThreads; thread++)
+		memset(threads[thread].values, 0, sizeof(threads[thread].values));
+}
+
+void Instrumentation::Report(FILE* file)
+{
+#ifndef INSTRUMENT
+	fprintf(file, "# instrumentation disabled, rebuild with INSTRUMENT=1\n");
+#endif
+	for (int phase = 0; phase < PhaseCount; phase++) {
+		bool header = false;
+		for (int counter = 0; counter < CounterCount; counter++) {
+			long value = Get((InstrumentPhase)phase, (InstrumentCounter)counter);
+			if (value == 0)
+				continue;
+			if (!header)
+				fprintf(file, "# %s\n", PhaseName(phase));
+			header = true;
+			fprintf(file, "%20s %16ld\n", CounterName(counter), value);
+		}
+		if (!header)
+			continue;
+		// derived ratios to tell compute-bound from memory-bound phases
+		long flops = Get((InstrumentPhase)phase, CountFlops);
+		long bytes = Get((InstrumentPhase)phase, CountBytes);
+		long cycles = Get((InstrumentPhase)phase, CountCycles);
+		long instructions = Get((InstrumentPhase)phase, CountInstructions);
+		long misses = Get((InstrumentPhase)phase, CountCacheMisses);
+		if (bytes > 0)
+			fprintf(file, "%20s %16.3f\n", "flops/byte", (double)flops / bytes);
+		if (cycles > 0) {
+			fprintf(file, "%20s %16.3f\n", "instructions/cycle", (double)instructions / cycles);
+			fprintf(file, "%20s %16.3f\n", "misses/kcycle", 1000.0 * misses / cycles);
+		}
+	}
+}
+
+Instrumentation::PhaseScope::PhaseScope(const InstrumentPhase phase)
+: previous(currentPhase)
+{
+	if (perfEnabled && previous != PhaseNone)
+		StopPerfCounters(previous);
+	currentPhase = phase;
+	if (perfEnabled)
+		StartPerfCounters();
+}
+
+Instrumentation::PhaseScope::~PhaseScope()
+{
+	if (perfEnabled)
+		StopPerfCounters(currentPhase);
+	currentPhase = previous;
+	if (perfEnabled && previous != PhaseNone)
+		StartPerfCounters();
+}
+
+#ifdef __linux__
+
+/// Open a user-space hardware counter of the calling thread
+static int OpenPerfCounter(const unsigned long config, const int group)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.disabled = (group == -1);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+bool Instrumentation::EnablePerfCounters()
+{
+	int leader = OpenPerfCounter(PERF_COUNT_HW_CPU_CYCLES, -1);
+	if (leader < 0)
+		return false;
+	close(leader);
+	perfEnabled = true;
+	return true;
+}
+
+void Instrumentation::StartPerfCounters()
+{
+	#pragma omp parallel
+	{
+		// threads in the shared slot go without hardware counters, their descriptors would collide
+		int thread = ThreadIndex();
+		int* fds = threads[thread].perfDescriptors;
+		if (thread != SharedSlot) {
+			fds[0] = OpenPerfCounter(PERF_COUNT_HW_CPU_CYCLES, -1);
+			fds[1] = fds[0] < 0 ? -1 : OpenPerfCounter(PERF_COUNT_HW_INSTRUCTIONS, fds[0]);
+			fds[2] = fds[0] < 0 ? -1 : OpenPerfCounter(PERF_COUNT_HW_CACHE_MISSES, fds[0]);
+		}
+		if (thread != SharedSlot && fds[0] >= 0) {
+			ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+			ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		}
+	}
+}
+
+void Instrumentation::StopPerfCounters(const int phase)
+{
+	#pragma omp parallel
+	{
+		int thread = ThreadIndex();
+		ThreadCounters& counters = threads[thread];
+		int* fds = counters.perfDescriptors;
+		if (thread != SharedSlot && fds[0] >= 0) {
+			ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+			// group format: number of events followed by their values in the order they were opened
+			unsigned long long values[4] = { 0, 0, 0, 0 };
+			if (read(fds[0], values, sizeof(values)) > 0) {
+				const InstrumentCounter order[3] = { CountCycles, CountInstructions, CountCacheMisses };
+				int value = 1;
+				for (int i = 0; i < 3 && value <= values[0]; i++)
+					if (fds[i] >= 0)
+						counters.values[phase][order[i]] += values[value++];
+			}
+		}
+		for (int i = 0; i < 3 && thread != SharedSlot; i++) {
+			if (fds[i] >= 0)
+				close(fds[i]);
+			fds[i] = -1;
+		}
+	}
+}
+
+#else
+
+bool Instrumentation::EnablePerfCounters()
+{
+	return false;
+}
+
+void Instrumentation::StartPerfCounters()
+{
+}
+
+void Instrumentation::StopPerfCounters(const int phase)
+{
+}
+
+#endif
+
+#ifdef INSTRUMENT
+
+// count every heap allocation towards the current phase
+
+void* operator new(std::size_t size)
+{
+	Instrumentation::Count(CountAllocations, 1);
+	Instrumentation::Count(CountAllocatedBytes, size);
+	void* pointer = malloc(size);
+	if (!pointer)
+		throw std::bad_alloc();
+	return pointer;
+}
+
+void operator delete(void* pointer) noexcept
+{
+	free(pointer);
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef Instrumentation_h
+#define Instrumentation_h
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+
+/// Phases of the solvers that are instrumented separately
+enum InstrumentPhase {
+	PhaseNone, PhaseBuild, PhaseP2M, PhaseM2M, PhaseM2L, PhaseL2L, PhaseL2P, PhaseP2P,
+	PhaseBHCharge, PhaseBHEvaluate, PhaseDirect, PhaseCount
+};
+
+/// Quantities counted per phase
+enum InstrumentCounter {
+	CountP2M, CountM2M, CountM2L, CountL2L, CountL2P, CountP2PPairs, CountBHVisits, CountBHFarField,
+	CountFlops, CountTranscendentals, CountBytes, CountAllocations, CountAllocatedBytes,
+	CountCycles, CountInstructions, CountCacheMisses, CounterCount
+};
+
+/// Operation counts of one kernel invocation
+struct KernelCost {
+	/// Real additions, multiplications and divisions
+	long flops;
+	/// Calls to log, exp, pow and friends
+	long transcendentals;
+	/// Bytes read or written, including temporaries
+	long bytes;
+};
+
+/// Per-phase operation counters and hardware performance counters.
+/// The counting macros compile to nothing unless INSTRUMENT is defined.
+class Instrumentation {
+
+public:
+
+	/// Maximum number of threads with their own counters
+	static const int MaxThreads = 256;
+
+	/// Slot of the counters shared, and updated atomically, by the threads beyond the first MaxThreads - 1
+	static const int SharedSlot = MaxThreads - 1;
+
+	/// Counters of one thread, padded to avoid false sharing
+	struct alignas(64) ThreadCounters {
+		long values[PhaseCount][CounterCount];
+		int perfDescriptors[3];
+	};
+
+	/// Counters of all threads
+	static ThreadCounters threads[MaxThreads];
+
+	/// Number of slots handed out to threads so far
+	static std::atomic<int> slots;
+
+	/// Phase that counts are currently attributed to
+	static int currentPhase;
+
+	/// Read cycles, instructions and cache misses through perf_event_open around each phase
+	static bool perfEnabled;
+
+	/// Add to a counter of the current phase
+	static inline void Count(const InstrumentCounter counter, const long n)
+	{
+		int thread = ThreadIndex();
+		Add(thread, threads[thread].values[currentPhase][counter], n);
+	}
+
+	/// Add the cost of a number of kernel invocations to the current phase
+	static inline void CountKernel(const InstrumentCounter kernel, const long calls, const KernelCost& cost)
+	{
+		int thread = ThreadIndex();
+		long* values = threads[thread].values[currentPhase];
+		Add(thread, values[kernel], calls);
+		Add(thread, values[CountFlops], calls * cost.flops);
+		Add(thread, values[CountTranscendentals], calls * cost.transcendentals);
+		Add(thread, values[CountBytes], calls * cost.bytes);
+	}
+
+	/// Total of a counter over all threads
+	static long Get(const InstrumentPhase phase, const InstrumentCounter counter);
+
+	/// Reset all counters
+	static void Reset();
+
+	/// Enable hardware counters, returns false if perf_event_open is not available
+	static bool EnablePerfCounters();
+
+	/// Print a table of all non-zero counters per phase
+	static void Report(FILE* file);
+
+	/// Name of a phase
+	static const char* PhaseName(const int phase);
+
+	/// Name of a counter
+	static const char* CounterName(const int counter);
+
+	/// Attribute counts to a phase for the lifetime of the scope; must be created outside parallel regions
+	class PhaseScope {
+	public:
+		PhaseScope(const InstrumentPhase phase);
+		~PhaseScope();
+	private:
+		int previous;
+	};
+
+private:
+
+	/// Slot of the calling thread, fixed for its lifetime. omp_get_thread_num() is only unique
+	/// within a team and repeats across nested regions, so slots are handed out in order of first use.
+	static inline int ThreadIndex()
+	{
+		static thread_local int slot = std::min(slots++, (int)SharedSlot);
+		return slot;
+	}
+
+	/// Add to a counter of a slot, atomically if the slot is shared
+	static inline void Add(const int thread, long& value, const long n)
+	{
+		if (thread == SharedSlot) {
+			#pragma omp atomic
+			value += n;
+		} else {
+			value += n;
+		}
+	}
+
+	/// Open and start the hardware counters on every thread
+	static void StartPerfCounters();
+
+	/// Stop the hardware counters on every thread and add them to a phase
+	static void StopPerfCounters(const int phase);
+
+};
+
+#ifdef INSTRUMENT
+#define INSTRUMENT_PHASE(phase) Instrumentation::PhaseScope instrumentPhaseScope(phase)
+#define INSTRUMENT_COUNT(counter, n) Instrumentation::Count(counter, n)
+#define INSTRUMENT_KERNEL(kernel, calls, cost) Instrumentation::CountKernel(kernel, calls, cost)
+#else
+#define INSTRUMENT_PHASE(phase)
+#define INSTRUMENT_COUNT(counter, n)
+#define INSTRUMENT_KERNEL(kernel, calls, cost)
+#endif
+
+#endif
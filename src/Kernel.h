@@ -0,0 +1,140 @@
+#ifndef Kernel_h
+#define Kernel_h
+
+#include "GeneralUtilities.h"
+
+/// Radially symmetric interaction kernel G(r) of the kernel-independent solvers
+class Kernel {
+
+public:
+
+	/// Destructor
+	virtual ~Kernel()
+	{
+
+	}
+
+	/// Kernel value at squared distance r2 > 0
+	virtual double Evaluate(const double r2) const = 0;
+
+	/// Short name for reports
+	virtual const char* Name() const = 0;
+
+	/// Length scale of the kernel, zero if it has none
+	virtual double Parameter() const
+	{
+		return 0;
+	}
+
+};
+
+/// 2D Coulomb potential log(r), the kernel of the analytic Potential
+class LogKernel : public Kernel {
+
+public:
+
+	virtual double Evaluate(const double r2) const
+	{
+		return 0.5 * log(r2);
+	}
+
+	virtual const char* Name() const
+	{
+		return "log";
+	}
+
+};
+
+/// Screened (Yukawa) potential -K0(lambda r), which approaches log(r) up to a constant as lambda goes to zero
+class YukawaKernel : public Kernel {
+
+public:
+
+	/// Inverse screening length
+	double lambda;
+
+	/// Constructor
+	YukawaKernel(const double lambda) : lambda(lambda)
+	{
+
+	}
+
+	virtual double Evaluate(const double r2) const
+	{
+		return -BesselK0(lambda * sqrt(r2));
+	}
+
+	virtual const char* Name() const
+	{
+		return "yukawa";
+	}
+
+	virtual double Parameter() const
+	{
+		return lambda;
+	}
+
+	/// Modified Bessel function of the second kind K0(x) for x > 0, to about machine precision
+	static inline double BesselK0(const double x)
+	{
+		if (x <= 2) {
+			// K0 = -(log(x / 2) + gamma) I0 + sum of (x^2 / 4)^k / (k!)^2 H_k, with harmonic numbers H_k
+			const double euler = 0.5772156649015329;
+			double t = 0.25 * x * x, term = 1, i0 = 1, sum = 0, harmonic = 0;
+			for (int k = 1; k < 40; k++) {
+				term *= t / ((double)k * k);
+				harmonic += 1.0 / k;
+				i0 += term;
+				sum += term * harmonic;
+				if (term < 1.0e-17 * i0)
+					break;
+			}
+			return -(log(0.5 * x) + euler) * i0 + sum;
+		}
+		// K0 is the integral of exp(-x cosh t) over t > 0; the trapezoidal rule converges
+		// exponentially for this integrand and 0.25 gives full precision
+		const double h = 0.25;
+		double sum = 0.5 * exp(-x);
+		for (double t = h; ; t += h) {
+			double value = exp(-x * cosh(t));
+			sum += value;
+			if (value < 1.0e-18 * sum)
+				break;
+		}
+		return h * sum;
+	}
+
+};
+
+/// Gaussian exp(-r^2 / sigma^2)
+class GaussianKernel : public Kernel {
+
+public:
+
+	/// Width of the Gaussian
+	double sigma;
+
+	/// Constructor
+	GaussianKernel(const double sigma) : sigma(sigma)
+	{
+
+	}
+
+	virtual double Evaluate(const double r2) const
+	{
+		return exp(-r2 / (sigma * sigma));
+	}
+
+	virtual const char* Name() const
+	{
+		return "gaussian";
+	}
+
+	virtual double Parameter() const
+	{
+		return sigma;
+	}
+
+};
+
+#endif
@@ -1,48 +1,328 @@
+#include <stdexcept>
+#include <omp.h>
 #include "MLFMM.h"
+#include "Snapshot.h"
+
+/// Schedule of the schedule(runtime) loops over leaves for the lifetime of the scope: static in
+/// NUMA mode, dynamic otherwise. The previous setting of the caller is restored on exit.
+class LeafSchedule {
+public:
+	LeafSchedule(const bool numa)
+	{
+		omp_get_schedule(&kind, &chunk);
+		omp_set_schedule(numa ? omp_sched_static : omp_sched_dynamic, 0);
+	}
+	~LeafSchedule()
+	{
+		omp_set_schedule(kind, chunk);
+	}
+private:
+	omp_sched_t kind;
+	int chunk;
+};
 
 MLFMM::MLFMM(const int levels, Potential& potential) 
-: levels(levels), flops(0) 
+: levels(levels), periodic(false), netCharge(0), neutralityWarned(false), flops(0) 
+{
+	maxLevel = levels - 1;
+	degrees.resize(levels, potential.degree);
+	this->potential = &potential;
+	InitializeStructure();
+	SetLeafRange(0, 1 << (2 * maxLevel));
+}
+
+MLFMM::MLFMM(const int levels, Potential& potential, const std::vector<int>& degrees) 
+: MLFMM(levels, potential, degrees, 0, 1 << (2 * (levels - 1)))
+{
+
+}
+
+MLFMM::MLFMM(const int levels, Potential& potential, const std::vector<int>& degrees, const int begin, const int end) 
+: levels(levels), degrees(degrees), periodic(false), netCharge(0), neutralityWarned(false), flops(0) 
 {
 	maxLevel = levels - 1;
+	// kernel-independent expansions have a fixed number of coefficients
+	if (!potential.IsAnalytic())
+		this->degrees.assign(levels, potential.degree);
+	if (this->degrees.size() != levels)
+		throw std::invalid_argument("MLFMM: need one degree per level");
+	for (auto &degree : this->degrees)
+		if (degree < 1)
+			throw std::invalid_argument("MLFMM: degrees must be at least 1");
 	this->potential = &potential;
 	InitializeStructure();
+	SetLeafRange(begin, end);
 }
 
 MLFMM::~MLFMM() 
 {
+	if (!threadNode.empty())
+		RestoreThreads(threadAffinity);
 	for (int level = maxLevel; level >= 0; level--)
 		for (int index = 0; index < structure[level].size(); index++)
 			delete structure[level][index]; 
 }
 
-void MLFMM::Solve() 
+bool MLFMM::Prepare()
+{
+	if (periodic && levels < 3) {
+		// the periodic near field needs at least 4 x 4 leaves so that the images of the neighbors are distinct
+		fprintf(stderr, "periodic mode needs at least 3 levels\n");
+		return false;
+	}
+	if (periodic && !potential->IsAnalytic()) {
+		// the lattice operator is derived for the log kernel
+		fprintf(stderr, "periodic mode needs the analytic log potential\n");
+		return false;
+	}
+	if (periodic && IsPartial()) {
+		// the lattice operator and the wrapped lists need every box
+		fprintf(stderr, "periodic mode needs the whole tree\n");
+		return false;
+	}
+	if (periodic)
+		RaisePeriodicDegrees();
+	return true;
+}
+
+bool MLFMM::Solve() 
 {
+	if (!Prepare())
+		return false;
+	ClearExpansions();
 	MultipoleExpansion();
 	MultipoleToMultipoleTranslation();
 	MultipoleToLocalTranslation();
 	LocalToLocalTranslation();
 	LocalExpansion();
+	NearFieldInteraction();
+	return true;
+}
+
+bool MLFMM::Restore(const SnapshotFile& snapshot)
+{
+	INSTRUMENT_PHASE(PhaseBuild);
+	if (IsPartial()) {
+		fprintf(stderr, "snapshots can only be restored into the whole tree\n");
+		return false;
+	}
+	const SnapshotHeader* header = snapshot.header;
+	const bool periodicSnapshot = (header->flags & SnapshotFile::Periodic) != 0;
+	bool matches = header->levels == levels && sources.empty() && targets.empty() && snapshot.Matches(*potential);
+	// a periodic snapshot was saved with the raised degrees, which this tree only takes on once it
+	// accepts the snapshot
+	const std::vector<int> expected = (matches && periodicSnapshot && levels >= 3 && potential->IsAnalytic()) ? PeriodicDegrees() : degrees;
+	for (int level = 0; level < levels && matches; level++)
+		matches = snapshot.degrees[level] == expected[level];
+	if (!matches) {
+		fprintf(stderr, "snapshot does not match the tree\n");
+		return false;
+	}
+	periodic = periodicSnapshot;
+	if (periodic)
+		RaisePeriodicDegrees();
+	netCharge = header->netCharge;
+	latticeOperator.assign(header->latticeSize, ComplexVec());
+	for (int i = 0; i < header->latticeSize; i++)
+		latticeOperator[i].assign(snapshot.lattice + i * header->latticeSize, snapshot.lattice + (i + 1) * header->latticeSize);
+
+	// the sources are stored leaf by leaf, so they go straight into their boxes
+	const bool coincident = (header->flags & SnapshotFile::Coincident) != 0;
+	particleBlocks.push_back(std::vector<Point>());
+	std::vector<Point>& block = particleBlocks.back();
+	block.reserve(header->count);
+	sources.reserve(header->count);
+	if (coincident)
+		targets.reserve(header->count);
+	for (int leaf = 0; leaf < structure[maxLevel].size(); leaf++) {
+		Box* box = structure[maxLevel][leaf];
+		int begin = snapshot.leafOffsets[leaf], end = snapshot.leafOffsets[leaf + 1];
+		box->Reserve(end - begin, coincident ? end - begin : 0);
+		for (int i = begin; i < end; i++) {
+			block.emplace_back(Complex(snapshot.x[i], snapshot.y[i]), (int)snapshot.index[i], snapshot.charge[i]);
+			Point* point = &block.back();
+			point->potential = snapshot.potential[i];
+			sources.push_back(point);
+			box->AddSource(point);
+			if (coincident) {
+				targets.push_back(point);
+				box->AddTarget(point);
+			}
+		}
+	}
+
+	const Complex* coeffs = snapshot.expansions;
+	for (int level = 0; level <= maxLevel; level++) {
+		for (auto &box : structure[level]) {
+			box->externalMultipoleCoeffs.assign(coeffs, coeffs + box->degree);
+			coeffs += box->degree;
+			box->localMultipoleCoeffs.assign(coeffs, coeffs + box->degree);
+			coeffs += box->degree;
+		}
+	}
+	return true;
+}
+
+bool MLFMM::Evaluate(const Complex& point, double& result)
+{
+	Complex z = point;
+	if (periodic) {
+		// the potential has the period of the unit square
+		z = Complex(real(z) - floor(real(z)), imag(z) - floor(imag(z)));
+		z = Complex(real(z) < 1 ? real(z) : 0, imag(z) < 1 ? imag(z) : 0);
+	}
+	if (!(real(z) >= 0 && real(z) < 1 && imag(z) >= 0 && imag(z) < 1) || IsPartial())
+		return false;
+	Box* box = structure[maxLevel][GetBoxIndex(z, maxLevel)];
+	const double x = real(z), y = imag(z);
+	result = 0;
+	potential->BoxLocalExpansion(box, &x, &y, 1, &result);
+	potential->EvaluateDirect(&x, &y, 1, box->sourceX.data(), box->sourceY.data(), box->sourceQ.data(), box->sources.size(), &result);
+	if (periodic) {
+		for (auto &image : GetPeriodicNeighbors(box))
+			potential->EvaluateDirect(&x, &y, 1, image.box->sourceX.data(), image.box->sourceY.data(), image.box->sourceQ.data(), image.box->sources.size(), &result, image.shift);
+		if (netCharge != 0)
+			result -= netCharge * Potential::RectanglePotential(z, -1, 2, -1, 2);
+	} else {
+		for (auto &neighbor : GetNeighbors(box))
+			potential->EvaluateDirect(&x, &y, 1, neighbor->sourceX.data(), neighbor->sourceY.data(), neighbor->sourceQ.data(), neighbor->sources.size(), &result);
+	}
+	return true;
+}
+
+bool MLFMM::DistributeForNUMA()
+{
+	INSTRUMENT_PHASE(PhaseBuild);
+	if (!threadNode.empty())
+		return true;
+	threadNode = PinThreads(NUMATopology::Detect(), threadAffinity);
+	if (threadNode.empty())
+		return false;
+	// the same static schedules as the passes hand every box to the thread that will process it;
+	// the coincident near field goes by colours and looks up the holder of each leaf instead
+	leafThread.assign(structure[maxLevel].size(), 0);
+	for (int level = 0; level <= maxLevel; level++) {
+		#pragma omp parallel for schedule(static)
+		for (int index = ActiveBegin(level); index < ActiveEnd(level); index++) {
+			structure[level][index]->Rehome();
+			if (level == maxLevel)
+				leafThread[index] = omp_get_thread_num();
+		}
+	}
+	return true;
+}
+
+void MLFMM::ClearExpansions() 
+{
+	for (int level = 0; level <= maxLevel; level++) {
+		for (auto &box : structure[level]) {
+			if (!box)
+				continue;
+			std::fill(box->externalMultipoleCoeffs.begin(), box->externalMultipoleCoeffs.end(), Complex(0,0));
+			std::fill(box->localMultipoleCoeffs.begin(), box->localMultipoleCoeffs.end(), Complex(0,0));
+			std::fill(box->localMultipoleCoeffsTilde.begin(), box->localMultipoleCoeffsTilde.end(), Complex(0,0));
+		}
+	}
 }
 
 void MLFMM::DirectSolve() 
 {
-	for (auto &target : targets) {
+	INSTRUMENT_PHASE(PhaseDirect);
+	if (sources == targets) {
+		// each pair once, in tiles of blocks of particles. The tiles of a round write disjoint
+		// blocks (a round-robin tournament of the blocks), so no thread needs a private copy of
+		// the potentials, and every potential is summed in the same order whatever the threads.
+		const int N = targets.size();
+		std::vector<double> x(N), y(N), q(N), total(N, 0.0);
+		for (int i = 0; i < N; i++) {
+			x[i] = real(targets[i]->coord);
+			y[i] = imag(targets[i]->coord);
+			q[i] = targets[i]->charge;
+		}
+		const int block = 512;
+		const int blocks = (N + block - 1) / block;
+		// an odd number of blocks gets a dummy block that sits out one pairing per round
+		const int players = blocks + (blocks % 2);
+		#pragma omp parallel
+		{
+			#pragma omp for schedule(dynamic)
+			for (int b = 0; b < blocks; b++) {
+				int begin = b * block, n = std::min(block, N - begin);
+				potential->EvaluateDirectSelf(&x[begin], &y[begin], &q[begin], n, &total[begin]);
+				INSTRUMENT_KERNEL(CountP2PPairs, (long)n * (n - 1) / 2, Potential::P2PSymmetricCost());
+			}
+			for (int round = 0; round + 1 < players; round++) {
+				#pragma omp for schedule(dynamic)
+				for (int k = 0; k < players / 2; k++) {
+					int first = (k == 0) ? players - 1 : (round + k) % (players - 1);
+					int second = (round - k + players - 1) % (players - 1);
+					if (first >= blocks || second >= blocks)
+						continue;
+					int begin1 = first * block, n1 = std::min(block, N - begin1);
+					int begin2 = second * block, n2 = std::min(block, N - begin2);
+					potential->EvaluateDirectMutual(&x[begin1], &y[begin1], &q[begin1], n1, &total[begin1],
+						&x[begin2], &y[begin2], &q[begin2], n2, &total[begin2]);
+					INSTRUMENT_KERNEL(CountP2PPairs, (long)n1 * n2, Potential::P2PSymmetricCost());
+				}
+			}
+		}
+		for (int i = 0; i < N; i++)
+			targets[i]->potential = total[i];
+		return;
+	}
+	#pragma omp parallel for schedule(static)
+	for (int index = 0; index < targets.size(); index++) {
+		Point* target = targets[index];
 		target->potential = 0.0;
 		for (auto &source : sources){
 			if (source->coord != target->coord) {
-				target->potential += potential->DirectEvaluate(target->coord, source->coord);
+				target->potential += source->charge * potential->DirectEvaluate(target->coord, source->coord);
 			}
 		}
+		INSTRUMENT_KERNEL(CountP2PPairs, sources.size(), Potential::P2PCost());
 	}
 }
 
 void MLFMM::InitializeStructure() 
 {
+	INSTRUMENT_PHASE(PhaseBuild);
+	potential->PrecomputeOperators(levels);
+	leafBegin = leafEnd = 0;
 	structure.resize(levels, std::vector<Box*>());
-	for (int level = 0; level < levels; level++) {
-		structure[level].resize((int)pow(4, level));
+	for (int level = 0; level < levels; level++)
+		structure[level].resize((int)pow(4, level), NULL);
+}
+
+void MLFMM::SetLeafRange(const int begin, const int end)
+{
+	INSTRUMENT_PHASE(PhaseBuild);
+	leafBegin = begin;
+	leafEnd = end;
+	std::vector<std::vector<bool>> needed(levels);
+	std::vector<int> indices;
+	for (int level = 0; level <= maxLevel; level++) {
+		needed[level].resize(structure[level].size(), false);
+		for (int index = ActiveBegin(level); index < ActiveEnd(level); index++) {
+			needed[level][index] = true;
+			// halo leaves for the near field, the rest of the locally essential tree for M2L
+			indices.clear();
+			if (level == maxLevel)
+				NeighborIndices(level, index, indices);
+			if (level >= 2)
+				InteractionIndices(level, index, indices);
+			for (auto &other : indices)
+				needed[level][other] = true;
+		}
+	}
+	for (int level = 0; level <= maxLevel; level++) {
 		for (int index = 0; index < structure[level].size(); index++) {
-			structure[level][index] = new Box(level, index, potential->degree);
+			Box*& box = structure[level][index];
+			if (needed[level][index] && !box) {
+				box = new Box(level, index, degrees[level]);
+			} else if (!needed[level][index] && box) {
+				delete box;
+				box = NULL;
+			}
 		}
 	}
 }
@@ -59,6 +339,40 @@ void MLFMM::AddTarget(Point* target) {
 	structure[maxLevel][index]->AddTarget(target);
 }
 
+bool MLFMM::AddParticles(const ParticleFile& file, const size_t chunk)
+{
+	INSTRUMENT_PHASE(PhaseBuild);
+	std::vector<int> counts(structure[maxLevel].size(), 0);
+	bool inside = true;
+	file.ForEachChunk(chunk, [&](const size_t begin, const size_t end) {
+		for (size_t i = begin; i < end && inside; i++) {
+			inside = file.x[i] >= 0 && file.x[i] < 1 && file.y[i] >= 0 && file.y[i] < 1;
+			if (inside)
+				counts[GetBoxIndex(Complex(file.x[i], file.y[i]), maxLevel)]++;
+		}
+	});
+	if (!inside) {
+		fprintf(stderr, "particle outside the unit square\n");
+		return false;
+	}
+
+	for (int index = 0; index < structure[maxLevel].size(); index++)
+		structure[maxLevel][index]->Reserve(counts[index], counts[index]);
+	sources.reserve(sources.size() + file.count);
+	targets.reserve(targets.size() + file.count);
+	particleBlocks.push_back(std::vector<Point>());
+	std::vector<Point>& block = particleBlocks.back();
+	block.reserve(file.count);
+	file.ForEachChunk(chunk, [&](const size_t begin, const size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			block.emplace_back(Complex(file.x[i], file.y[i]), (int)i, file.Charge(i));
+			AddSource(&block.back());
+			AddTarget(&block.back());
+		}
+	});
+	return true;
+}
+
 int MLFMM::GetBoxIndex(const Complex& coord, const int level) 
 {
 	return interleave(
@@ -80,24 +394,52 @@ std::vector<Box*> MLFMM::GetChildren(Box* box)
 	return children;
 }
 
-std::vector<Box*> MLFMM::GetNeighbors(Box* box) 
+void MLFMM::NeighborIndices(const int level, const int index, std::vector<int>& indices)
 {
-	std::vector<Box*> neighbors;
-	Complex location = uninterleave(box->index, box->level);
+	Complex location = uninterleave(index, level);
 	int x = (int)real(location);
 	int y = (int)imag(location);
+	int n = 1 << level;
 	for (int i = -1; i <= 1; i++) {
 		for (int j = -1; j <= 1; j++) {
 			// keep in bounds
-			if ((i != 0 || j != 0)  
-				&& (x + i >= 0)
-				&& (y + j >= 0)
-				&& (x + i < pow(2, box->level)) 
-				&& (y + j < pow(2, box->level))) {
-				neighbors.push_back(structure[box->level][interleave(x + i, y + j, box->level)]);
+			if ((i != 0 || j != 0) && x + i >= 0 && y + j >= 0 && x + i < n && y + j < n)
+				indices.push_back(interleave(x + i, y + j, level));
+		}
+	}
+}
+
+void MLFMM::InteractionIndices(const int level, const int index, std::vector<int>& indices)
+{
+	// children of the parent's neighbors that are not neighbors, in the order of the parent's
+	// neighbors and then of the children, without touching the boxes
+	Complex location = uninterleave(index, level);
+	int x = (int)real(location);
+	int y = (int)imag(location);
+	int n = 1 << (level - 1);
+	for (int i = -1; i <= 1; i++) {
+		for (int j = -1; j <= 1; j++) {
+			int px = (x >> 1) + i, py = (y >> 1) + j;
+			if ((i == 0 && j == 0) || px < 0 || py < 0 || px >= n || py >= n)
+				continue;
+			int parent = interleave(px, py, level - 1);
+			for (int child = 0; child < 4; child++) {
+				int candidate = (parent << 2) + child;
+				Complex other = uninterleave(candidate, level);
+				if (abs((int)real(other) - x) > 1 || abs((int)imag(other) - y) > 1)
+					indices.push_back(candidate);
 			}
 		}
 	}
+}
+
+std::vector<Box*> MLFMM::GetNeighbors(Box* box) 
+{
+	std::vector<int> indices;
+	NeighborIndices(box->level, box->index, indices);
+	std::vector<Box*> neighbors;
+	for (auto &index : indices)
+		neighbors.push_back(structure[box->level][index]);
 	return neighbors;
 }
 
@@ -111,92 +453,337 @@ bool MLFMM::IsNeighbor(Box* box, Box* candidate)
 
 std::vector<Box*> MLFMM::GetInteractionList(Box* box) 
 {
+	std::vector<int> indices;
+	InteractionIndices(box->level, box->index, indices);
 	std::vector<Box*> interactionList;
-	std::vector<Box*> neighbors = GetNeighbors(box);
-	for (auto &parentsNeighbor : GetNeighbors(GetParent(box)))
-		for (auto &candidate : GetChildren(parentsNeighbor))
-			if (box != candidate && !IsNeighbor(box, candidate))
-				interactionList.push_back(candidate);
+	for (auto &index : indices)
+		interactionList.push_back(structure[box->level][index]);
 	return interactionList;
 }
 
-void MLFMM::MultipoleExpansion() 
+std::vector<BoxImage> MLFMM::GetPeriodicNeighbors(Box* box) 
+{
+	std::vector<BoxImage> neighbors;
+	Complex location = uninterleave(box->index, box->level);
+	int x = (int)real(location);
+	int y = (int)imag(location);
+	int n = 1 << box->level;
+	for (int i = -1; i <= 1; i++) {
+		for (int j = -1; j <= 1; j++) {
+			if (i == 0 && j == 0)
+				continue;
+			// wrap around the domain; the shift moves the wrapped box next to this one
+			int shiftX = (x + i < 0) ? -1 : ((x + i >= n) ? 1 : 0);
+			int shiftY = (y + j < 0) ? -1 : ((y + j >= n) ? 1 : 0);
+			Box* neighbor = structure[box->level][interleave(x + i - shiftX * n, y + j - shiftY * n, box->level)];
+			neighbors.push_back(BoxImage{ neighbor, Complex(shiftX, shiftY) });
+		}
+	}
+	return neighbors;
+}
+
+std::vector<BoxImage> MLFMM::GetPeriodicInteractionList(Box* box) 
 {
-	for (auto &box : structure[maxLevel]){
-		for (auto &source : box->sources){
-			box->externalMultipoleCoeffs += potential->GetMultipoleCoeffs(source->coord, box->center);
-			flops += potential->degree; 
+	std::vector<BoxImage> interactionList;
+	Complex location = uninterleave(box->index, box->level);
+	int x = (int)real(location);
+	int y = (int)imag(location);
+	int n = 1 << box->level;
+	for (auto &parentsNeighbor : GetPeriodicNeighbors(GetParent(box))) {
+		for (auto &candidate : GetChildren(parentsNeighbor.box)) {
+			// compare positions of the images in the unwrapped integer coordinates of this level
+			Complex other = uninterleave(candidate->index, candidate->level) + parentsNeighbor.shift * (double)n;
+			if (abs((int)real(other) - x) > 1 || abs((int)imag(other) - y) > 1)
+				interactionList.push_back(BoxImage{ candidate, parentsNeighbor.shift });
 		}
 	}
+	return interactionList;
+}
+
+void MLFMM::MultipoleExpansion() 
+{
+	INSTRUMENT_PHASE(PhaseP2M);
+	long count = 0;
+	LeafSchedule schedule(!threadNode.empty());
+	#pragma omp parallel for reduction(+:count) schedule(runtime)
+	for (int index = leafBegin; index < leafEnd; index++) {
+		Box* box = structure[maxLevel][index];
+		potential->BoxMultipoleExpansion(box);
+		count += box->degree * box->sources.size(); 
+		INSTRUMENT_KERNEL(CountP2M, box->sources.size(), Potential::P2MCost(box->degree));
+	}
+	flops += count;
 }
 
 void MLFMM::MultipoleToMultipoleTranslation() 
 {
-	for (int level = maxLevel; level >= 2; level--) {
-		for (auto &box : structure[level]) {
-			Box* parent = GetParent(box);
-			parent->externalMultipoleCoeffs += potential->MultipoleToMultipole(box->center, parent->center, box->externalMultipoleCoeffs);
-			flops += potential->degree * potential->degree; 
+	INSTRUMENT_PHASE(PhaseM2M);
+	long count = 0;
+	for (int level = maxLevel - 1; level >= (periodic ? 0 : 1); level--) {
+		// gather over the children so that each parent is written by one thread
+		#pragma omp parallel for reduction(+:count) schedule(static)
+		for (int index = ActiveBegin(level); index < ActiveEnd(level); index++) {
+			Box* parent = structure[level][index];
+			for (auto &box : GetChildren(parent)) {
+				// children outside a partial tree hold no sources of it
+				if (!box)
+					continue;
+				potential->BoxMultipoleToMultipole(box, parent);
+				count += box->degree * parent->degree; 
+				INSTRUMENT_KERNEL(CountM2M, 1, Potential::M2MCost(box->degree, parent->degree));
+			}
 		}
 	}
+	flops += count;
 }
 
 void MLFMM::MultipoleToLocalTranslation() 
 {
+	INSTRUMENT_PHASE(PhaseM2L);
+	long count = 0;
+	if (periodic) {
+		// the interaction lists of level 1 cover the 3 x 3 block of images of the domain, the rest is the lattice
+		LatticeTranslation();
+		for (int level = 1; level <= maxLevel; level++) {
+			#pragma omp parallel for reduction(+:count) schedule(static)
+			for (int index = ActiveBegin(level); index < ActiveEnd(level); index++) {
+				Box* box = structure[level][index];
+				for (auto &image : GetPeriodicInteractionList(box)) {
+					potential->BoxMultipoleToLocal(image.box, box, image.shift);
+					count += box->degree * box->degree;
+					INSTRUMENT_KERNEL(CountM2L, 1, Potential::M2LCost(image.box->degree, box->degree));
+				}
+			}
+		}
+		flops += count;
+		return;
+	}
 	for (int level = 2; level <= maxLevel; level++) {
-		for (auto &box : structure[level]) {
+		#pragma omp parallel for reduction(+:count) schedule(static)
+		for (int index = ActiveBegin(level); index < ActiveEnd(level); index++) {
+			Box* box = structure[level][index];
 			for (auto &neighbor : GetInteractionList(box)) {
-				box->localMultipoleCoeffsTilde += potential->MultipoleToLocal(neighbor->center, box->center, neighbor->externalMultipoleCoeffs);
-				flops += potential->degree * potential->degree;
+				potential->BoxMultipoleToLocal(neighbor, box, Complex(0, 0));
+				count += box->degree * box->degree;
+				INSTRUMENT_KERNEL(CountM2L, 1, Potential::M2LCost(neighbor->degree, box->degree));
 			}
 		}
 	}
+	flops += count;
+}
+
+void MLFMM::LatticeTranslation() 
+{
+	Box* root = structure[0][0];
+	if (latticeOperator.size() != root->degree)
+		latticeOperator = Potential::PeriodicLatticeOperator(root->degree);
+	const ComplexVec& multipole = root->externalMultipoleCoeffs;
+	ComplexVec& local = root->localMultipoleCoeffsTilde;
+	local += potential->ApplyTranslation(latticeOperator, multipole, root->degree);
+	flops += root->degree * root->degree;
+
+	// lattice sums over square shells leave the field of the polarized infinite square, -pi times the
+	// dipole moment; remove it so that the potential is periodic. The dipole moment is -a_1.
+	if (root->degree > 1)
+		local[1] -= M_PI * conj(multipole[1]);
+
+	netCharge = real(multipole[0]);
+	if (fabs(netCharge) > 1.0e-12 * sources.size() && !neutralityWarned) {
+		fprintf(stderr, "warning: periodic system has net charge %g, compensated by a uniform background\n", netCharge);
+		neutralityWarned = true;
+	}
+}
+
+std::vector<int> MLFMM::PeriodicDegrees() const
+{
+	// the reference level is not raised itself, so raising twice changes nothing
+	std::vector<int> raised = degrees;
+	const int reference = std::min(3, maxLevel);
+	for (int level = reference - 1; level >= 0; level--)
+		raised[level] = std::max(degrees[level], degrees[reference] + PeriodicMargin);
+	return raised;
+}
+
+void MLFMM::RaisePeriodicDegrees()
+{
+	const std::vector<int> raised = PeriodicDegrees();
+	for (int level = 0; level <= maxLevel; level++) {
+		if (raised[level] == degrees[level])
+			continue;
+		degrees[level] = raised[level];
+		for (auto &box : structure[level]) {
+			box->degree = raised[level];
+			box->externalMultipoleCoeffs.resize(raised[level], Complex(0, 0));
+			box->localMultipoleCoeffs.resize(raised[level], Complex(0, 0));
+			box->localMultipoleCoeffsTilde.resize(raised[level], Complex(0, 0));
+		}
+	}
 }
 
 void MLFMM::LocalToLocalTranslation() 
 {
-	for (auto &box : structure[2]) {
+	INSTRUMENT_PHASE(PhaseL2L);
+	long count = 0;
+	const int top = periodic ? 0 : 2;
+	for (int index = ActiveBegin(top); index < ActiveEnd(top); index++) {
+		Box* box = structure[top][index];
 		box->localMultipoleCoeffs += box->localMultipoleCoeffsTilde;
-		flops += potential->degree;
+		count += box->degree;
 	}
-	for (int level = 2; level < maxLevel; level++) {
-		for (auto &box : structure[level]) {
+	for (int level = top; level < maxLevel; level++) {
+		#pragma omp parallel for reduction(+:count) schedule(static)
+		for (int index = ActiveBegin(level); index < ActiveEnd(level); index++) {
+			Box* box = structure[level][index];
 			for (auto &child : GetChildren(box)) {
+				if (!child)
+					continue;
 				child->localMultipoleCoeffs += child->localMultipoleCoeffsTilde;
-				child->localMultipoleCoeffs += potential->LocalToLocal(box->center, child->center, box->localMultipoleCoeffs);
-				flops += potential->degree * potential->degree + potential->degree;
+				potential->BoxLocalToLocal(box, child);
+				count += box->degree * child->degree + child->degree;
+				INSTRUMENT_KERNEL(CountL2L, 1, Potential::L2LCost(box->degree, child->degree));
 			}
 		}
 	}
+	flops += count;
 }
 
-void MLFMM::MLFMM::LocalExpansion() 
+void MLFMM::LocalExpansion() 
 {
-	for (auto &box : structure[maxLevel]) {
-		for (auto &target : box->targets) {
-			double outsidePotential = 0.0;
-			ComplexVec localVector = potential->GetLocalCoeffs(target->coord, box->center);
-			for (int k = 0; k < potential->degree; k++) {
-				outsidePotential += real(box->localMultipoleCoeffs[k] * localVector[k]);
+	INSTRUMENT_PHASE(PhaseL2P);
+	long count = 0;
+	LeafSchedule schedule(!threadNode.empty());
+	#pragma omp parallel for reduction(+:count) schedule(runtime)
+	for (int index = leafBegin; index < leafEnd; index++) {
+		Box* box = structure[maxLevel][index];
+		box->targetPotential.assign(box->targets.size(), 0.0);
+		potential->BoxLocalExpansion(box);
+		if (periodic && netCharge != 0) {
+			// background charge of the 3 x 3 block of images, the rest of it is in the lattice operator
+			for (int t = 0; t < box->targets.size(); t++)
+				box->targetPotential[t] -= netCharge * Potential::RectanglePotential(Complex(box->targetX[t], box->targetY[t]), -1, 2, -1, 2);
+		}
+		for (int t = 0; t < box->targets.size(); t++)
+			box->targets[t]->potential = box->targetPotential[t];
+		count += box->degree * box->targets.size();
+		INSTRUMENT_KERNEL(CountL2P, box->targets.size(), Potential::L2PCost(box->degree));
+	}
+	flops += count;
+}
+
+bool MLFMM::IsCoincident() 
+{
+	for (int index = leafBegin; index < leafEnd; index++)
+		if (!structure[maxLevel][index]->IsCoincident())
+			return false;
+	return true;
+}
+
+void MLFMM::NearFieldInteraction() 
+{
+	INSTRUMENT_PHASE(PhaseP2P);
+	long count = 0;
+	LeafSchedule schedule(!threadNode.empty());
+	if (IsCoincident()) {
+		// each pair of neighboring leaves is evaluated once, from the leaf with the lower x (or the
+		// lower y for equal x), updating both. Leaves of the same colour (x mod 2, y mod 3) never
+		// touch a common leaf this way, so each colour is processed in parallel without races.
+		const int offsets[8][2] = { {1, -1}, {1, 0}, {1, 1}, {0, 1}, {-1, -1}, {-1, 0}, {-1, 1}, {0, -1} };
+		const int half = 4;
+		const int n = 1 << maxLevel;
+		// in periodic mode the rows y = 0 and y = n - 1 wrap around and break the colouring in y;
+		// they form a seventh colour that is processed serially
+		std::vector<int> colours[7];
+		for (int index = leafBegin; index < leafEnd; index++) {
+			Complex location = uninterleave(index, maxLevel);
+			int y = (int)imag(location);
+			if (periodic && (y == 0 || y == n - 1))
+				colours[6].push_back(index);
+			else
+				colours[((int)real(location) % 2) + 2 * (y % 3)].push_back(index);
+		}
+		auto interact = [&](Box* box) -> long {
+			int size = box->sources.size();
+			potential->EvaluateDirectSelf(box->sourceX.data(), box->sourceY.data(), box->sourceQ.data(), size, box->targetPotential.data());
+			long pairs = (long)size * (size - 1) / 2;
+			INSTRUMENT_KERNEL(CountP2PPairs, pairs, Potential::P2PSymmetricCost());
+			Complex location = uninterleave(box->index, maxLevel);
+			int x = (int)real(location);
+			int y = (int)imag(location);
+			for (int o = 0; o < 8; o++) {
+				int i = x + offsets[o][0], j = y + offsets[o][1];
+				Complex shift(0, 0);
+				if (periodic) {
+					shift = Complex((i < 0) ? -1 : ((i >= n) ? 1 : 0), (j < 0) ? -1 : ((j >= n) ? 1 : 0));
+					i -= (int)real(shift) * n;
+					j -= (int)imag(shift) * n;
+				} else if (i < 0 || j < 0 || i >= n || j >= n) {
+					continue;
+				}
+				Box* neighbor = structure[maxLevel][interleave(i, j, maxLevel)];
+				if (neighbor->index < leafBegin || neighbor->index >= leafEnd) {
+					// sources outside the active range have no targets here to update
+					potential->EvaluateDirect(box->targetX.data(), box->targetY.data(), size,
+						neighbor->sourceX.data(), neighbor->sourceY.data(), neighbor->sourceQ.data(), neighbor->sources.size(), box->targetPotential.data(), shift);
+					INSTRUMENT_KERNEL(CountP2PPairs, (long)size * neighbor->sources.size(), Potential::P2PCost());
+				} else if (o < half) {
+					potential->EvaluateDirectMutual(box->sourceX.data(), box->sourceY.data(), box->sourceQ.data(), size, box->targetPotential.data(),
+						neighbor->sourceX.data(), neighbor->sourceY.data(), neighbor->sourceQ.data(), neighbor->sources.size(), neighbor->targetPotential.data(), shift);
+					INSTRUMENT_KERNEL(CountP2PPairs, (long)size * neighbor->sources.size(), Potential::P2PSymmetricCost());
+				} else {
+					continue;
+				}
+				pairs += (long)size * neighbor->sources.size();
 			}
-			flops += potential->degree;
-			double insidePotential = 0.0;
-			for (auto &source : box->sources) {
-				if (source->coord != target->coord){
-					insidePotential += potential->DirectEvaluate(target->coord, source->coord);
-					flops += 1;
+			return pairs;
+		};
+		for (int c = 0; c < 7; c++) {
+			const std::vector<int>& colour = colours[c];
+			if (!threadNode.empty() && c < 6) {
+				// in NUMA mode each thread takes the leaves of the colour that it holds
+				#pragma omp parallel reduction(+:count)
+				{
+					int thread = omp_get_thread_num(), team = omp_get_num_threads();
+					for (int k = 0; k < colour.size(); k++)
+						if (leafThread[colour[k]] % team == thread)
+							count += interact(structure[maxLevel][colour[k]]);
 				}
+			} else {
+				#pragma omp parallel for reduction(+:count) schedule(runtime) if (c < 6)
+				for (int k = 0; k < colour.size(); k++)
+					count += interact(structure[maxLevel][colour[k]]);
 			}
-			for (auto &neighbor : GetNeighbors(box)) {
-				for (auto &source : neighbor->sources) {
-					if (source->coord != target->coord) {
-						insidePotential += potential->DirectEvaluate(target->coord, source->coord);
-						flops += 1;
-					}
+		}
+	} else {
+		#pragma omp parallel for reduction(+:count) schedule(runtime)
+		for (int index = leafBegin; index < leafEnd; index++) {
+			Box* box = structure[maxLevel][index];
+			int size = box->targets.size();
+			long pairs = (long)size * box->sources.size();
+			potential->EvaluateDirect(box->targetX.data(), box->targetY.data(), size,
+				box->sourceX.data(), box->sourceY.data(), box->sourceQ.data(), box->sources.size(), box->targetPotential.data());
+			if (periodic) {
+				for (auto &image : GetPeriodicNeighbors(box)) {
+					Box* neighbor = image.box;
+					potential->EvaluateDirect(box->targetX.data(), box->targetY.data(), size,
+						neighbor->sourceX.data(), neighbor->sourceY.data(), neighbor->sourceQ.data(), neighbor->sources.size(), box->targetPotential.data(), image.shift);
+					pairs += (long)size * neighbor->sources.size();
+				}
+			} else {
+				for (auto &neighbor : GetNeighbors(box)) {
+					potential->EvaluateDirect(box->targetX.data(), box->targetY.data(), size,
+						neighbor->sourceX.data(), neighbor->sourceY.data(), neighbor->sourceQ.data(), neighbor->sources.size(), box->targetPotential.data());
+					pairs += (long)size * neighbor->sources.size();
 				}
 			}
-			target->potential = outsidePotential + insidePotential;
-			flops += 1;
+			INSTRUMENT_KERNEL(CountP2PPairs, pairs, Potential::P2PCost());
+			count += pairs;
 		}
 	}
+	#pragma omp parallel for schedule(static)
+	for (int index = leafBegin; index < leafEnd; index++) {
+		Box* box = structure[maxLevel][index];
+		for (int t = 0; t < box->targets.size(); t++)
+			box->targets[t]->potential = box->targetPotential[t];
+	}
+	flops += count;
 }
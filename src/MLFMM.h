@@ -5,6 +5,16 @@
 #include "Point.h"
 #include "FMMPotential.h"
 #include "FMMBox.h"
+#include "ParticleIO.h"
+#include "NUMA.h"
+
+class SnapshotFile;
+
+/// A box and the shift of the periodic image of it that takes part in an interaction
+struct BoxImage {
+	Box* box;
+	Complex shift;
+};
 
 class MLFMM {
 
@@ -14,14 +24,54 @@ public:
 	int levels;
 	/// Index of the deepest level in the tree
 	int maxLevel; 
+
+	/// Truncation number of each level
+	std::vector<int> degrees;
 	
 	/// Collection of sources
 	std::vector<Point*> sources;
 	/// Collection of targets
 	std::vector<Point*> targets;
+
+	/// Points created by AddParticles, one contiguous block per call so that earlier blocks never move
+	std::vector<std::vector<Point>> particleBlocks;
 	
-	/// Hierarchical tree structure
+	/// Hierarchical tree structure, indexed by level and Morton index. Boxes a partial tree does
+	/// not need are null.
 	std::vector<std::vector<Box*>> structure; 
+
+	/// Periodic boundary conditions on the unit square, set before Solve. The potential is the
+	/// periodic (Ewald) solution: net charge is compensated by a uniform background and the
+	/// dipole of the unit cell does not create a field. The top levels get PeriodicMargin more terms
+	/// than the level below them. Not supported by DirectSolve and DistributedMLFMM.
+	bool periodic;
+
+	/// Extra terms of the levels above the third (above the leaves for three levels) in periodic
+	/// mode, whose expansions also reach the images of the domain and the lattice. With them the
+	/// periodic error matches the free-space error at the same degree.
+	static const int PeriodicMargin = 4;
+
+	/// Translation of the root multipole expansion into the root local expansion from the far periodic images
+	ComplexMat latticeOperator;
+
+	/// Net charge of the sources, a uniform background of opposite charge is added in periodic mode
+	double netCharge;
+
+	/// Whether the net charge warning has been printed
+	bool neutralityWarned;
+
+	/// NUMA node of each OpenMP thread after DistributeForNUMA, empty when not in NUMA mode
+	std::vector<int> threadNode;
+
+	/// OpenMP thread that holds the memory of each leaf after DistributeForNUMA
+	std::vector<int> leafThread;
+
+	/// Affinity of the OpenMP threads before DistributeForNUMA, restored by the destructor
+	ThreadAffinity threadAffinity;
+
+	/// Range [leafBegin, leafEnd) of leaf indices, in Morton order, whose targets are evaluated.
+	/// The passes skip boxes outside it; the whole tree by default. Set by SetLeafRange().
+	int leafBegin, leafEnd;
 	
 	/// Multipole potential
 	Potential* potential; 
@@ -32,23 +82,75 @@ public:
 	/// Constructor 
 	MLFMM(const int levels, Potential& potential);
 
+	/// Constructor with a truncation number per level, ignored for kernel-independent potentials.
+	/// Throws std::invalid_argument unless there is one degree of at least 1 per level.
+	MLFMM(const int levels, Potential& potential, const std::vector<int>& degrees);
+
+	/// Constructor of a partial tree evaluating only the leaves [begin, end), see SetLeafRange()
+	MLFMM(const int levels, Potential& potential, const std::vector<int>& degrees, const int begin, const int end);
+
 	/// Destructor 
 	~MLFMM();
 
-	/// Initialize FMM tree structure
+	/// Initialize FMM tree structure, without boxes
 	void InitializeStructure();
 
+	/// Evaluate only the leaves [begin, end) and keep only the boxes the passes need: those
+	/// overlapping the range, the neighbors of its leaves (the halo) and the interaction lists of
+	/// its boxes (the locally essential tree). Other boxes are deleted, so call it before adding
+	/// particles, which must lie in the range or its halo.
+	void SetLeafRange(const int begin, const int end);
+
 	/// Add a source to the FMM tree
 	void AddSource(Point* source);
 
 	/// Add a target to the FMM tree
 	void AddTarget(Point* target);
 
-	/// Solve by direct evaluation of the potential
+	/// Add every particle of a mapped file as a source and a target, indexed by file row. The file is
+	/// streamed twice in chunks, once to count the particles per leaf and once to bin them into
+	/// storage reserved to its final size. Only the pages of the file are released after binning:
+	/// each particle is copied into a Point and into the arrays of its leaf, so the tree takes
+	/// about three times the size of the file and must fit in memory. Returns false if a particle
+	/// is outside the unit square.
+	bool AddParticles(const ParticleFile& file, const size_t chunk = ParticleFile::DefaultChunk);
+
+	/// Switch to NUMA mode after adding the particles: pin the OpenMP threads to the NUMA nodes in
+	/// equal shares and reallocate the arrays of every box in the thread that processes it. All
+	/// passes then use static schedules over Morton order, and the coincident near field splits
+	/// each colour by the thread holding the leaf, so each node works on the contiguous range of
+	/// boxes whose memory it holds. Suits roughly uniform distributions; the number of
+	/// threads must not change afterwards. The threads stay pinned until the tree is destroyed.
+	/// Returns false if the threads could not be pinned.
+	bool DistributeForNUMA();
+
+	/// Solve by direct evaluation of the potential, each pair once if sources and targets are the same.
+	/// The result does not depend on the number of threads.
 	void DirectSolve();
 
-	/// Solve using the Fast Multipole Method
-	void Solve();
+	/// Check the configuration before the passes and set up periodic mode, which needs at least 3
+	/// levels, the analytic log potential and the whole tree, by raising the top-level degrees. Solve() calls it;
+	/// callers running the passes themselves must call it first. Returns false, with a message, if
+	/// the configuration is invalid.
+	bool Prepare();
+
+	/// Solve using the Fast Multipole Method. Returns false, leaving the potentials of the targets
+	/// untouched, if Prepare() fails.
+	bool Solve();
+
+	/// Restore the sources, expansions and periodic state of a solved tree from a snapshot into
+	/// this empty tree, which must have the same levels, degrees and kind of potential. The
+	/// sources are also added as targets if they were targets of the saved tree. Partial trees
+	/// are refused.
+	bool Restore(const SnapshotFile& snapshot);
+
+	/// Potential at a point from the expansions and sources of a solved or restored tree. Returns
+	/// false for a point outside the unit square, periodic trees wrap the point into it instead,
+	/// and for any point of a partial tree.
+	bool Evaluate(const Complex& z, double& result);
+
+	/// Reset all multipole and local expansion coefficients to zero
+	void ClearExpansions();
 
 	/// Multipole expansion
 	void MultipoleExpansion();
@@ -59,12 +161,47 @@ public:
 	/// Multipole-to-local translation
 	void MultipoleToLocalTranslation();
 
+	/// Add the far periodic images of the root and the dipole correction to the root local expansion
+	void LatticeTranslation();
+
+	/// Degrees per level with the top levels given PeriodicMargin more terms than the level below
+	/// them, if they have fewer
+	std::vector<int> PeriodicDegrees() const;
+
+	/// Give the boxes the degrees of PeriodicDegrees()
+	void RaisePeriodicDegrees();
+
 	/// Local-to-local translation
 	void LocalToLocalTranslation();
 
-	/// Local expansion
+	/// Local expansion, evaluating the far field at the targets
 	void LocalExpansion();
 
+	/// Near-field interaction of the targets with the sources of their own and neighboring leaves,
+	/// added to the local expansion. Each pair is evaluated once when IsCoincident().
+	void NearFieldInteraction();
+
+	/// Check if every active leaf has the same points as sources and targets
+	bool IsCoincident();
+
+	/// Whether SetLeafRange() restricted the tree to part of the leaves, so that some boxes are null
+	inline bool IsPartial() const
+	{
+		return leafBegin != 0 || leafEnd != (int)structure[maxLevel].size();
+	}
+
+	/// First box of a level that overlaps the active leaf range
+	inline int ActiveBegin(const int level) const
+	{
+		return leafBegin >> (2 * (maxLevel - level));
+	}
+
+	/// One past the last box of a level that overlaps the active leaf range
+	inline int ActiveEnd(const int level) const
+	{
+		return (leafEnd > leafBegin) ? ((leafEnd - 1) >> (2 * (maxLevel - level))) + 1 : ActiveBegin(level);
+	}
+
 	/// Get the index of box from a coordinate and level
 	int GetBoxIndex(const Complex& coord, const int level);
 
@@ -74,6 +211,12 @@ public:
 	/// Get the children of a box as a std::vector of boxes
 	std::vector<Box*> GetChildren(Box* box);
 	
+	/// Append the indices of the neighbors of a box at a level
+	static void NeighborIndices(const int level, const int index, std::vector<int>& indices);
+
+	/// Append the indices of the interaction list of a box at a level of at least 2
+	static void InteractionIndices(const int level, const int index, std::vector<int>& indices);
+
 	/// Get the neighbors of a box as a std::vector of boxes
 	std::vector<Box*> GetNeighbors(Box* box);
 
@@ -83,6 +226,12 @@ public:
 	/// Get the interaction list of a box as a std::vector of boxes
 	std::vector<Box*> GetInteractionList(Box* box);
 
+	/// Get the neighbors of a box modulo the domain, with the shifts of their images
+	std::vector<BoxImage> GetPeriodicNeighbors(Box* box);
+
+	/// Get the interaction list of a box modulo the domain, with the shifts of their images
+	std::vector<BoxImage> GetPeriodicInteractionList(Box* box);
+
 };
 
 #endif
\ No newline at end of file
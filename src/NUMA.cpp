@@ -0,0 +1,98 @@
+#include <cstdio>
+#include <sched.h>
+#include <omp.h>
+#include "NUMA.h"
+
+/// Parse a sysfs CPU list such as "0-3,8-11"
+static std::vector<int> ParseCPUList(FILE* file)
+{
+	std::vector<int> cpus;
+	int first, last;
+	while (fscanf(file, "%d", &first) == 1) {
+		last = first;
+		int separator = fgetc(file);
+		if (separator == '-') {
+			if (fscanf(file, "%d", &last) != 1)
+				break;
+			separator = fgetc(file);
+		}
+		for (int cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+		if (separator != ',')
+			break;
+	}
+	return cpus;
+}
+
+NUMATopology NUMATopology::Detect()
+{
+	NUMATopology topology;
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return topology;
+	for (int node = 0; ; node++) {
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE* file = fopen(path, "r");
+		if (!file)
+			break;
+		std::vector<int> cpus;
+		for (auto &cpu : ParseCPUList(file))
+			if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+				cpus.push_back(cpu);
+		fclose(file);
+		if (!cpus.empty())
+			topology.cpus.push_back(cpus);
+	}
+	if (topology.cpus.empty()) {
+		topology.cpus.push_back(std::vector<int>());
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &allowed))
+				topology.cpus[0].push_back(cpu);
+	}
+	return topology;
+}
+
+std::vector<int> PinThreads(const NUMATopology& topology, ThreadAffinity& previous)
+{
+	const int threads = omp_get_max_threads();
+	const int nodes = topology.Nodes();
+	std::vector<int> threadNode(threads, 0);
+	if (nodes == 0) {
+		fprintf(stderr, "warning: no NUMA topology to pin threads to\n");
+		return std::vector<int>();
+	}
+	previous.assign(threads, cpu_set_t());
+	bool pinned = true;
+	#pragma omp parallel num_threads(threads) reduction(&&:pinned)
+	{
+		int thread = omp_get_thread_num();
+		int node = (long)thread * nodes / threads;
+		threadNode[thread] = node;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (auto &cpu : topology.cpus[node])
+			CPU_SET(cpu, &set);
+		// pid 0 is the calling thread
+		pinned = sched_getaffinity(0, sizeof(previous[thread]), &previous[thread]) == 0
+			&& sched_setaffinity(0, sizeof(set), &set) == 0;
+	}
+	if (!pinned) {
+		fprintf(stderr, "warning: could not pin threads to NUMA nodes\n");
+		RestoreThreads(previous);
+		threadNode.clear();
+	}
+	return threadNode;
+}
+
+void RestoreThreads(const ThreadAffinity& previous)
+{
+	#pragma omp parallel num_threads(previous.size())
+	{
+		// a thread whose mask could not be read has an empty mask and was not pinned
+		const cpu_set_t& mask = previous[omp_get_thread_num()];
+		if (CPU_COUNT(&mask) > 0)
+			sched_setaffinity(0, sizeof(mask), &mask);
+	}
+}
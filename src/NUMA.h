@@ -0,0 +1,33 @@
+#ifndef NUMA_h
+#define NUMA_h
+
+#include <vector>
+#include <sched.h>
+
+/// NUMA nodes of the machine and the CPUs of each, from /sys/devices/system/node. Without that
+/// information all CPUs available to the process form a single node.
+struct NUMATopology {
+	/// CPUs of each node that the process may run on; nodes without such CPUs are left out
+	std::vector<std::vector<int>> cpus;
+
+	/// Read the topology of the machine
+	static NUMATopology Detect();
+
+	/// Number of nodes
+	inline int Nodes() const { return cpus.size(); }
+};
+
+/// Affinity masks of the threads of the OpenMP thread pool, by thread number
+typedef std::vector<cpu_set_t> ThreadAffinity;
+
+/// Pin the threads of the OpenMP thread pool to the nodes of a topology, the first threads to the
+/// first node and so on in equal shares, each to all CPUs of its node. The previous masks are
+/// saved in previous. Returns the node of each thread, or an empty vector if pinning failed, in
+/// which case the previous masks are already restored. Later parallel regions with the same
+/// number of threads run on the same pinned threads until RestoreThreads.
+std::vector<int> PinThreads(const NUMATopology& topology, ThreadAffinity& previous);
+
+/// Give the threads of the OpenMP thread pool back the masks saved by PinThreads
+void RestoreThreads(const ThreadAffinity& previous);
+
+#endif
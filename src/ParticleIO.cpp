@@ -0,0 +1,260 @@
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ParticleIO.h"
+
+static const char particleMagic[8] = "HNBPART";
+static const char potentialMagic[8] = "HNBPOT";
+
+/// Check the header of a mapped file against a magic tag and its length, returns false on mismatch
+static bool CheckHeader(const std::string& path, const void* mapping, const size_t length, const char* magic,
+	const uint32_t minColumns, const uint32_t maxColumns)
+{
+	const ParticleFileHeader* header = (const ParticleFileHeader*)mapping;
+	if (length < sizeof(ParticleFileHeader) || memcmp(header->magic, magic, sizeof(header->magic)) != 0) {
+		fprintf(stderr, "%s: not a %s file\n", path.c_str(), magic);
+		return false;
+	}
+	if (header->version != ParticleFile::Version) {
+		fprintf(stderr, "%s: unsupported version %u\n", path.c_str(), header->version);
+		return false;
+	}
+	// divide the length rather than multiply the count, which a malformed header could overflow
+	if (header->columns < minColumns || header->columns > maxColumns
+		|| header->count > (length - sizeof(ParticleFileHeader)) / sizeof(double) / header->columns) {
+		fprintf(stderr, "%s: truncated or malformed file\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+void* MapFile(const std::string& path, const int descriptor, const int protection, size_t& length)
+{
+	struct stat status;
+	if (fstat(descriptor, &status) != 0) {
+		perror(path.c_str());
+		return 0;
+	}
+	length = status.st_size;
+	if (length == 0) {
+		fprintf(stderr, "%s: empty file\n", path.c_str());
+		return 0;
+	}
+	void* mapping = mmap(0, length, protection, MAP_SHARED, descriptor, 0);
+	if (mapping == MAP_FAILED) {
+		perror(path.c_str());
+		return 0;
+	}
+	return mapping;
+}
+
+ParticleFile::ParticleFile()
+: count(0), x(0), y(0), charge(0), mapping(0), length(0), descriptor(-1)
+{
+
+}
+
+ParticleFile::~ParticleFile()
+{
+	Close();
+}
+
+bool ParticleFile::Open(const std::string& path)
+{
+	Close();
+	descriptor = open(path.c_str(), O_RDONLY);
+	if (descriptor < 0) {
+		perror(path.c_str());
+		return false;
+	}
+	mapping = MapFile(path, descriptor, PROT_READ, length);
+	if (!mapping || !CheckHeader(path, mapping, length, particleMagic, 2, 3)) {
+		Close();
+		return false;
+	}
+	const ParticleFileHeader* header = (const ParticleFileHeader*)mapping;
+	if (header->count > INT_MAX) {
+		// Point::index is an int
+		fprintf(stderr, "%s: more than %d particles\n", path.c_str(), INT_MAX);
+		Close();
+		return false;
+	}
+	const double* columns = (const double*)(header + 1);
+	count = header->count;
+	x = columns;
+	y = columns + count;
+	charge = (header->columns == 3) ? columns + 2 * count : 0;
+	// the columns are read front to back while binning
+	madvise(mapping, length, MADV_SEQUENTIAL);
+	return true;
+}
+
+void ParticleFile::Close()
+{
+	if (mapping)
+		munmap(mapping, length);
+	if (descriptor >= 0)
+		close(descriptor);
+	mapping = 0;
+	descriptor = -1;
+	length = 0;
+	count = 0;
+	x = y = charge = 0;
+}
+
+void ParticleFile::Advise(const size_t begin, const size_t end, const int advice) const
+{
+	if (!mapping || begin >= end)
+		return;
+	const size_t page = sysconf(_SC_PAGESIZE);
+	const double* columns[3] = { x, y, charge };
+	for (auto &column : columns) {
+		if (!column)
+			continue;
+		// madvise takes whole pages; widen the byte range of the chunk to page boundaries
+		size_t from = ((const char*)(column + begin) - (const char*)mapping) / page * page;
+		size_t to = std::min(length, ((const char*)(column + end) - (const char*)mapping + page - 1) / page * page);
+		madvise((char*)mapping + from, to - from, advice);
+		if (advice == MADV_DONTNEED)
+			posix_fadvise(descriptor, from, to - from, POSIX_FADV_DONTNEED);
+	}
+}
+
+void ParticleFile::Prefetch(const size_t begin, const size_t end) const
+{
+	Advise(begin, end, MADV_WILLNEED);
+}
+
+void ParticleFile::Release(const size_t begin, const size_t end) const
+{
+	Advise(begin, end, MADV_DONTNEED);
+}
+
+bool ParticleFile::Write(const std::string& path, const size_t count, const double* x, const double* y, const double* charge)
+{
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file) {
+		perror(path.c_str());
+		return false;
+	}
+	ParticleFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, particleMagic, sizeof(header.magic));
+	header.version = Version;
+	header.columns = charge ? 3 : 2;
+	header.count = count;
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(x, sizeof(double), count, file) == count
+		&& fwrite(y, sizeof(double), count, file) == count
+		&& (!charge || fwrite(charge, sizeof(double), count, file) == count);
+	written = (fclose(file) == 0) && written;
+	if (!written)
+		fprintf(stderr, "%s: write failed\n", path.c_str());
+	return written;
+}
+
+bool ParticleFile::Write(const std::string& path, const std::vector<Point*>& points)
+{
+	std::vector<double> x(points.size()), y(points.size()), charge(points.size());
+	for (int i = 0; i < points.size(); i++) {
+		x[i] = real(points[i]->coord);
+		y[i] = imag(points[i]->coord);
+		charge[i] = points[i]->charge;
+	}
+	return Write(path, points.size(), x.data(), y.data(), charge.data());
+}
+
+PotentialFile::PotentialFile()
+: count(0), potential(0), mapping(0), length(0)
+{
+
+}
+
+PotentialFile::~PotentialFile()
+{
+	Close();
+}
+
+bool PotentialFile::Create(const std::string& path, const size_t count)
+{
+	Close();
+	int descriptor = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (descriptor < 0) {
+		perror(path.c_str());
+		return false;
+	}
+	size_t size = sizeof(ParticleFileHeader) + count * sizeof(double);
+	if (ftruncate(descriptor, size) != 0) {
+		perror(path.c_str());
+		close(descriptor);
+		return false;
+	}
+	mapping = MapFile(path, descriptor, PROT_READ | PROT_WRITE, length);
+	close(descriptor);
+	if (!mapping)
+		return false;
+	ParticleFileHeader* header = (ParticleFileHeader*)mapping;
+	memcpy(header->magic, potentialMagic, sizeof(header->magic));
+	header->version = ParticleFile::Version;
+	header->columns = 1;
+	header->count = count;
+	this->count = count;
+	potential = (double*)(header + 1);
+	return true;
+}
+
+bool PotentialFile::Open(const std::string& path)
+{
+	Close();
+	int descriptor = open(path.c_str(), O_RDWR);
+	if (descriptor < 0) {
+		perror(path.c_str());
+		return false;
+	}
+	mapping = MapFile(path, descriptor, PROT_READ | PROT_WRITE, length);
+	close(descriptor);
+	if (!mapping || !CheckHeader(path, mapping, length, potentialMagic, 1, 1)) {
+		Close();
+		return false;
+	}
+	ParticleFileHeader* header = (ParticleFileHeader*)mapping;
+	count = header->count;
+	potential = (double*)(header + 1);
+	return true;
+}
+
+void PotentialFile::Close()
+{
+	if (mapping) {
+		msync(mapping, length, MS_SYNC);
+		munmap(mapping, length);
+	}
+	mapping = 0;
+	length = 0;
+	count = 0;
+	potential = 0;
+}
+
+void PotentialFile::Store(const std::vector<Point*>& points)
+{
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < points.size(); i++)
+		if (points[i]->index >= 0 && points[i]->index < count)
+			potential[points[i]->index] = points[i]->potential;
+}
+
+void LoadPoints(const ParticleFile& file, std::vector<Point>& storage, std::vector<Point*>& points, const size_t chunk)
+{
+	storage.reserve(storage.size() + file.count);
+	points.reserve(points.size() + file.count);
+	file.ForEachChunk(chunk, [&](const size_t begin, const size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			storage.emplace_back(Complex(file.x[i], file.y[i]), (int)i, file.Charge(i));
+			points.push_back(&storage.back());
+		}
+	});
+}
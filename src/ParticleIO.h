@@ -0,0 +1,155 @@
+#ifndef ParticleIO_h
+#define ParticleIO_h
+
+#include <cstdint>
+#include <string>
+#include "GeneralUtilities.h"
+#include "Point.h"
+
+/// Header of the binary particle and potential files. It is followed by columns of count
+/// doubles in native byte order, each starting at a multiple of 8 bytes.
+struct ParticleFileHeader {
+	/// File type tag, "HNBPART" for particles and "HNBPOT" for potentials
+	char magic[8];
+	/// Format version
+	uint32_t version;
+	/// Number of columns after the header
+	uint32_t columns;
+	/// Number of particles, the length of every column
+	uint64_t count;
+	/// Reserved, zero
+	uint64_t reserved[5];
+};
+
+/// Read-only memory mapping of a binary particle file with x, y and optionally charge columns.
+/// Coordinates must lie in the unit square; a missing charge column means unit charges. The
+/// mapping does not make inputs larger than memory possible: MLFMM::AddParticles() copies every
+/// particle into the tree, which then holds about three times the size of the file.
+class ParticleFile {
+
+public:
+
+	/// Current format version
+	static const uint32_t Version = 1;
+
+	/// Default number of particles per chunk when streaming
+	static const size_t DefaultChunk = 1 << 20;
+
+	/// Number of particles
+	size_t count;
+
+	/// Coordinate columns, pointing into the mapping
+	const double *x, *y;
+
+	/// Charge column, pointing into the mapping, or null for unit charges
+	const double* charge;
+
+	/// Constructor
+	ParticleFile();
+
+	/// Destructor, unmaps the file
+	~ParticleFile();
+
+	/// Map a particle file, returns false on error
+	bool Open(const std::string& path);
+
+	/// Unmap the file
+	void Close();
+
+	/// Charge of particle i
+	inline double Charge(const size_t i) const
+	{
+		return charge ? charge[i] : 1.0;
+	}
+
+	/// Ask the kernel to read the pages of particles [begin, end) ahead
+	void Prefetch(const size_t begin, const size_t end) const;
+
+	/// Drop the pages of particles [begin, end) from memory; they are read again from the file on access
+	void Release(const size_t begin, const size_t end) const;
+
+	/// Call f(begin, end) on consecutive chunks of particles, reading the next chunk ahead and
+	/// releasing each chunk afterwards, so that only about two chunks of the file are resident
+	template <typename Function>
+	void ForEachChunk(const size_t chunk, Function f) const
+	{
+		Prefetch(0, std::min(chunk, count));
+		for (size_t begin = 0; begin < count; begin += chunk) {
+			size_t end = std::min(begin + chunk, count);
+			Prefetch(end, std::min(end + chunk, count));
+			f(begin, end);
+			Release(begin, end);
+		}
+	}
+
+	/// Write columns of coordinates and charges to a particle file, charges may be null
+	static bool Write(const std::string& path, const size_t count, const double* x, const double* y, const double* charge);
+
+	/// Write points to a particle file, in the order of the vector
+	static bool Write(const std::string& path, const std::vector<Point*>& points);
+
+private:
+
+	/// Apply madvise to the pages of particles [begin, end) in every column
+	void Advise(const size_t begin, const size_t end, const int advice) const;
+
+	/// Mapping of the whole file
+	void* mapping;
+	/// Length of the mapping in bytes
+	size_t length;
+	/// File descriptor, kept open for posix_fadvise
+	int descriptor;
+
+	ParticleFile(const ParticleFile&) = delete;
+	ParticleFile& operator=(const ParticleFile&) = delete;
+};
+
+/// Read-write memory mapping of a binary potential file with one column, in the row order of a particle file
+class PotentialFile {
+
+public:
+
+	/// Number of potentials
+	size_t count;
+
+	/// Potential column, pointing into the mapping
+	double* potential;
+
+	/// Constructor
+	PotentialFile();
+
+	/// Destructor, flushes and unmaps the file
+	~PotentialFile();
+
+	/// Create or truncate a potential file with room for count potentials and map it, returns false on error
+	bool Create(const std::string& path, const size_t count);
+
+	/// Map an existing potential file, returns false on error
+	bool Open(const std::string& path);
+
+	/// Flush and unmap the file
+	void Close();
+
+	/// Store the potentials of points in the rows given by their indices
+	void Store(const std::vector<Point*>& points);
+
+private:
+
+	/// Mapping of the whole file
+	void* mapping;
+	/// Length of the mapping in bytes
+	size_t length;
+
+	PotentialFile(const PotentialFile&) = delete;
+	PotentialFile& operator=(const PotentialFile&) = delete;
+};
+
+/// Map the whole file open as descriptor with a mmap protection and store its length, returns the mapping or null on error
+void* MapFile(const std::string& path, const int descriptor, const int protection, size_t& length);
+
+/// Create one point per particle of a file in a single contiguous allocation, indexed by file row,
+/// and append pointers to them to points. Pointers into storage are invalidated if it has to grow.
+void LoadPoints(const ParticleFile& file, std::vector<Point>& storage, std::vector<Point*>& points,
+	const size_t chunk = ParticleFile::DefaultChunk);
+
+#endif
@@ -14,9 +14,12 @@ public:
 	/// Potential evaluated at this point
 	double potential;
 
+	/// Charge of the point as a source
+	double charge;
+
 	/// Constructor
-	Point(const Complex& coord, const int index) 
-	: coord(coord), index(index)
+	Point(const Complex& coord, const int index, const double charge = 1.0) 
+	: coord(coord), index(index), charge(charge)
 	{
 		potential = 0;
 	}
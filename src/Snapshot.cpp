@@ -0,0 +1,202 @@
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "Snapshot.h"
+#include "Kernel.h"
+
+static const char snapshotMagic[8] = "HNBSNAP";
+
+SnapshotFile::SnapshotFile()
+: header(0), degrees(0), leafOffsets(0), x(0), y(0), charge(0), index(0), potential(0),
+  expansions(0), lattice(0), operators(0), mapping(0), length(0)
+{
+
+}
+
+SnapshotFile::~SnapshotFile()
+{
+	Close();
+}
+
+bool SnapshotFile::Open(const std::string& path)
+{
+	Close();
+	int descriptor = open(path.c_str(), O_RDONLY);
+	if (descriptor < 0) {
+		perror(path.c_str());
+		return false;
+	}
+	mapping = MapFile(path, descriptor, PROT_READ, length);
+	close(descriptor);
+	if (!mapping)
+		return false;
+	header = (const SnapshotHeader*)mapping;
+	if (length < sizeof(SnapshotHeader) || memcmp(header->magic, snapshotMagic, sizeof(header->magic)) != 0) {
+		fprintf(stderr, "%s: not a %s file\n", path.c_str(), snapshotMagic);
+		Close();
+		return false;
+	}
+	if (header->version != Version) {
+		fprintf(stderr, "%s: unsupported version %u\n", path.c_str(), header->version);
+		Close();
+		return false;
+	}
+	// walk the sections, checking each against the remaining length before reading from it; the
+	// sizes are bounded by division so that a malformed header cannot overflow them
+	size_t offset = sizeof(SnapshotHeader);
+	auto section = [&](const size_t count, const size_t size) -> const void* {
+		if (count > (length - offset) / size)
+			return 0;
+		const void* start = (const char*)mapping + offset;
+		offset += count * size;
+		return start;
+	};
+	const int levels = header->levels;
+	const size_t count = header->count;
+	bool valid = levels > 0 && levels < 16 && (degrees = (const uint64_t*)section(levels, sizeof(uint64_t)));
+	size_t coefficients = 0;
+	for (int level = 0; level < levels && valid; level++) {
+		// the coefficients of a level cannot exceed the file, which keeps the total from overflowing
+		valid = degrees[level] >= 1 && degrees[level] <= length / sizeof(Complex) / ((size_t)2 << (2 * level));
+		coefficients += ((size_t)1 << (2 * level)) * 2 * (valid ? degrees[level] : 0);
+	}
+	const size_t leaves = valid ? (size_t)1 << (2 * (levels - 1)) : 0;
+	valid = valid && (leafOffsets = (const uint64_t*)section(leaves + 1, sizeof(uint64_t)));
+	// the leaves partition [0, count) in order
+	valid = valid && leafOffsets[0] == 0 && leafOffsets[leaves] == count;
+	for (size_t leaf = 0; leaf < leaves && valid; leaf++)
+		valid = leafOffsets[leaf] <= leafOffsets[leaf + 1];
+	// Point::index is an int
+	const double* columns = 0;
+	valid = valid && count <= INT_MAX && count <= (length - offset) / (5 * sizeof(double))
+		&& (columns = (const double*)section(5 * count, sizeof(double)));
+	valid = valid && (expansions = (const Complex*)section(coefficients, sizeof(Complex)));
+	const size_t latticeSize = header->latticeSize;
+	valid = valid && (latticeSize == 0 || latticeSize <= (length - offset) / sizeof(Complex) / latticeSize)
+		&& (lattice = (const Complex*)section(latticeSize * latticeSize, sizeof(Complex)));
+	valid = valid && (operators = (const double*)section(header->operators, sizeof(double)));
+	// periodic trees need 4 x 4 leaves and a lattice operator
+	valid = valid && (!(header->flags & Periodic) || (levels >= 3 && latticeSize > 0));
+	if (valid) {
+		x = columns;
+		y = columns + count;
+		charge = columns + 2 * count;
+		index = columns + 3 * count;
+		potential = columns + 4 * count;
+	}
+	if (!valid) {
+		fprintf(stderr, "%s: truncated or malformed file\n", path.c_str());
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void SnapshotFile::Close()
+{
+	if (mapping)
+		munmap(mapping, length);
+	mapping = 0;
+	length = 0;
+	header = 0;
+	degrees = leafOffsets = 0;
+	x = y = charge = index = potential = operators = 0;
+	expansions = lattice = 0;
+}
+
+bool SnapshotFile::Matches(const Potential& potential) const
+{
+	const Kernel* kernel = potential.GetKernel();
+	if (((header->flags & Analytic) != 0) != potential.IsAnalytic())
+		return false;
+	if (!kernel)
+		return header->kernel[0] == 0;
+	return strncmp(header->kernel, kernel->Name(), sizeof(header->kernel)) == 0
+		&& header->kernelParameter == kernel->Parameter();
+}
+
+bool SnapshotFile::LoadOperators(Potential& potential) const
+{
+	if (!Matches(potential)) {
+		fprintf(stderr, "snapshot was saved with another kernel or kernel parameter\n");
+		return false;
+	}
+	if (!potential.ImportOperators(header->levels, operators, header->operators)) {
+		fprintf(stderr, "snapshot operators do not match the potential\n");
+		return false;
+	}
+	return true;
+}
+
+bool SnapshotFile::Write(const std::string& path, const MLFMM& tree)
+{
+	if (tree.IsPartial()) {
+		fprintf(stderr, "cannot write a snapshot of a partial tree\n");
+		return false;
+	}
+	const int maxLevel = tree.maxLevel;
+	const std::vector<Box*>& leaves = tree.structure[maxLevel];
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+	header.version = Version;
+	header.levels = tree.levels;
+	header.netCharge = tree.netCharge;
+	header.latticeSize = tree.periodic ? tree.latticeOperator.size() : 0;
+	if (const Kernel* kernel = tree.potential->GetKernel()) {
+		strncpy(header.kernel, kernel->Name(), sizeof(header.kernel) - 1);
+		header.kernelParameter = kernel->Parameter();
+	}
+	header.flags = (tree.periodic ? Periodic : 0) | (tree.potential->IsAnalytic() ? Analytic : 0) | Coincident;
+
+	// sources in leaf order, which is also the order in which a restored tree holds them
+	std::vector<uint64_t> offsets(1, 0);
+	std::vector<double> columns[5];
+	for (auto &leaf : leaves) {
+		if (!leaf->IsCoincident())
+			header.flags &= ~Coincident;
+		for (auto &source : leaf->sources) {
+			columns[0].push_back(real(source->coord));
+			columns[1].push_back(imag(source->coord));
+			columns[2].push_back(source->charge);
+			columns[3].push_back(source->index);
+			columns[4].push_back(source->potential);
+		}
+		offsets.push_back(columns[0].size());
+	}
+	header.count = columns[0].size();
+	if (!(header.flags & Coincident))
+		std::fill(columns[4].begin(), columns[4].end(), 0.0);
+	std::vector<uint64_t> degrees(tree.degrees.begin(), tree.degrees.end());
+	std::vector<double> operators;
+	tree.potential->ExportOperators(tree.levels, operators);
+	header.operators = operators.size();
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (!file) {
+		perror(path.c_str());
+		return false;
+	}
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(degrees.data(), sizeof(uint64_t), degrees.size(), file) == degrees.size()
+		&& fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), file) == offsets.size();
+	for (auto &column : columns)
+		written = written && fwrite(column.data(), sizeof(double), column.size(), file) == column.size();
+	for (int level = 0; level <= maxLevel && written; level++) {
+		for (auto &box : tree.structure[level]) {
+			written = written
+				&& fwrite(box->externalMultipoleCoeffs.data(), sizeof(Complex), box->degree, file) == box->degree
+				&& fwrite(box->localMultipoleCoeffs.data(), sizeof(Complex), box->degree, file) == box->degree;
+		}
+	}
+	for (int i = 0; i < header.latticeSize; i++)
+		written = written && fwrite(tree.latticeOperator[i].data(), sizeof(Complex), header.latticeSize, file) == header.latticeSize;
+	written = written && fwrite(operators.data(), sizeof(double), operators.size(), file) == operators.size();
+	written = (fclose(file) == 0) && written;
+	if (!written)
+		fprintf(stderr, "%s: write failed\n", path.c_str());
+	return written;
+}
@@ -0,0 +1,98 @@
+#ifndef Snapshot_h
+#define Snapshot_h
+
+#include <cstdint>
+#include <string>
+#include "MLFMM.h"
+
+/// Header of a snapshot file of a solved MLFMM, 96 bytes. It is followed by 8-byte aligned sections in this
+/// order: the degree of each level, the offsets of the leaves into the particle columns, the x, y,
+/// charge, index and potential columns of the sources in leaf order, the multipole and local
+/// expansions of every box level by level, the periodic lattice operator and the operator table
+/// of the potential.
+struct SnapshotHeader {
+	/// File type tag, "HNBSNAP"
+	char magic[8];
+	/// Format version
+	uint32_t version;
+	/// Number of levels of the tree
+	uint32_t levels;
+	/// Number of sources
+	uint64_t count;
+	/// Combination of the SnapshotFile flags
+	uint32_t flags;
+	/// Dimension of the lattice operator, zero if there is none
+	uint32_t latticeSize;
+	/// Net charge of the sources
+	double netCharge;
+	/// Number of doubles in the operator table of the potential
+	uint64_t operators;
+	/// Kernel::Name() of the kernel of a kernel-independent potential, empty for the analytic one
+	char kernel[16];
+	/// Kernel::Parameter() of that kernel
+	double kernelParameter;
+	/// Reserved, zero
+	uint64_t reserved[3];
+};
+
+/// Read-only memory mapping of a snapshot file, from which a query-only tree is restored without
+/// rebuilding or solving it
+class SnapshotFile {
+
+public:
+
+	/// Current format version
+	static const uint32_t Version = 2;
+
+	/// The tree was periodic
+	static const uint32_t Periodic = 1;
+	/// The sources were also the targets, so the potential column holds their solved potentials
+	static const uint32_t Coincident = 2;
+	/// The expansions are those of the analytic Potential
+	static const uint32_t Analytic = 4;
+
+	/// Header, pointing into the mapping
+	const SnapshotHeader* header;
+
+	/// Sections, pointing into the mapping
+	const uint64_t* degrees;
+	const uint64_t* leafOffsets;
+	const double *x, *y, *charge, *index, *potential;
+	const Complex* expansions;
+	const Complex* lattice;
+	const double* operators;
+
+	/// Constructor
+	SnapshotFile();
+
+	/// Destructor, unmaps the file
+	~SnapshotFile();
+
+	/// Map a snapshot file, returns false on error
+	bool Open(const std::string& path);
+
+	/// Unmap the file
+	void Close();
+
+	/// Whether a potential is of the kind, kernel and kernel parameter the snapshot was saved with
+	bool Matches(const Potential& potential) const;
+
+	/// Give the precomputed operators to a potential; call before constructing the tree with it.
+	/// Returns false if the potential does not match the snapshot.
+	bool LoadOperators(Potential& potential) const;
+
+	/// Write a solved tree to a snapshot file; partial trees are refused
+	static bool Write(const std::string& path, const MLFMM& tree);
+
+private:
+
+	/// Mapping of the whole file
+	void* mapping;
+	/// Length of the mapping in bytes
+	size_t length;
+
+	SnapshotFile(const SnapshotFile&) = delete;
+	SnapshotFile& operator=(const SnapshotFile&) = delete;
+};
+
+#endif
@@ -0,0 +1,228 @@
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include "Solver.h"
+#include "MLFMM.h"
+#include "BHNode.h"
+
+/// Largest error of Barnes-Hut for some targets relative to the largest exact potential, where
+/// an infinite opening parameter opens every node and gives the exact sum
+static double SampleError(BHNode& tree, const std::vector<Point*>& targets, const double theta)
+{
+	double error = 0, largest = 0;
+	for (auto &target : targets) {
+		double exact = tree.ComputePotential(target, HUGE_VAL);
+		error = std::max(error, fabs(tree.ComputePotential(target, theta) - exact));
+		largest = std::max(largest, fabs(exact));
+	}
+	return largest > 0 ? error / largest : 0;
+}
+
+/// Serial seconds of Barnes-Hut per target, best of three runs
+static double TraversalTime(BHNode& tree, const std::vector<Point*>& targets, const double theta)
+{
+	Timer timer;
+	double best = HUGE_VAL;
+	for (int repeat = 0; repeat < 3; repeat++) {
+		timer.Start();
+		for (auto &target : targets)
+			target->potential = tree.ComputePotential(target, theta);
+		best = std::min(best, timer.Elapsed());
+	}
+	return best / targets.size();
+}
+
+ClusteringStatistics ClusteringStatistics::Measure(const std::vector<Point*>& points)
+{
+	ClusteringStatistics statistics;
+	const int N = points.size();
+	statistics.level = std::min(10, std::max(1, (int)round(log(N / 16.0) / log(4.0))));
+	const int side = 1 << statistics.level;
+	std::vector<int> counts(side * side, 0);
+	bool positive = false, negative = false;
+	for (auto &point : points) {
+		int x = std::min(side - 1, (int)(real(point->coord) * side));
+		int y = std::min(side - 1, (int)(imag(point->coord) * side));
+		counts[interleave(x, y, statistics.level)]++;
+		positive = positive || point->charge > 0;
+		negative = negative || point->charge < 0;
+	}
+	double occupied = 0, sum = 0, squares = 0;
+	statistics.maxOccupancy = 0;
+	for (auto &count : counts) {
+		if (count == 0)
+			continue;
+		occupied += 1;
+		sum += count;
+		squares += (double)count * count;
+		statistics.maxOccupancy = std::max(statistics.maxOccupancy, count);
+	}
+	statistics.emptyFraction = 1.0 - occupied / counts.size();
+	statistics.occupiedMean = occupied > 0 ? sum / occupied : 0;
+	statistics.occupiedVariation = occupied > 0
+		? sqrt(std::max(0.0, squares / occupied - statistics.occupiedMean * statistics.occupiedMean)) / statistics.occupiedMean : 0;
+	statistics.mixedCharges = positive && negative;
+	return statistics;
+}
+
+Solver::Solver(const double tolerance, const std::string& cachePath)
+: tolerance(tolerance), clusterThreshold(2.0), emptyThreshold(0.5), maxTheta(4.0), engine(EngineFMM),
+  levels(0), degree(0), theta(0), depth(0), flops(0), tuner(cachePath)
+{
+
+}
+
+SolverEngine Solver::Choose(const std::vector<Point*>& points)
+{
+	const int N = points.size();
+	statistics = ClusteringStatistics::Measure(points);
+	char text[256];
+	if (N <= DirectLimit) {
+		engine = EngineDirect;
+		levels = 2;
+		degree = Potential::DegreeForTolerance(tolerance);
+		snprintf(text, sizeof(text), "N = %d is small: at most %d particles are summed directly", N, DirectLimit);
+		reason = text;
+		return engine;
+	}
+
+	// deeper trees than four levels below the statistics only pay off for extreme clusters, and
+	// the occupancy histograms of the tuner would dominate the run time of small sets
+	tuner.maxLevels = std::min(11, std::max(tuner.minLevels, statistics.level + 4));
+	TunedParameters tuned = tuner.Tune(points, tolerance);
+	levels = tuned.levels;
+	degree = tuned.degree;
+	// Barnes-Hut with one particle per leaf, deep enough to resolve the fullest leaf
+	depth = std::min(20, statistics.level + 2 + (int)ceil(log(std::max(1, statistics.maxOccupancy)) / log(4.0)));
+
+	// mostly empty leaves are clustered too, however evenly the others are filled
+	const bool clustered = statistics.occupiedVariation > clusterThreshold || statistics.emptyFraction > emptyThreshold;
+	double treeTime = HUGE_VAL;
+	theta = clustered && !statistics.mixedCharges ? CalibrateBarnesHut(points, treeTime) : 0;
+	char shape[128];
+	snprintf(shape, sizeof(shape), "occupied leaves vary by %.2f, %.0f%% of leaves empty at level %d",
+		statistics.occupiedVariation, 100 * statistics.emptyFraction, statistics.level);
+	if (!clustered) {
+		engine = EngineFMM;
+		snprintf(text, sizeof(text), "evenly filled: %s", shape);
+	} else if (statistics.mixedCharges) {
+		engine = EngineFMM;
+		snprintf(text, sizeof(text), "clustered (%s) but charges of both signs defeat Barnes-Hut monopoles", shape);
+	} else if (theta > maxTheta) {
+		engine = EngineFMM;
+		snprintf(text, sizeof(text), "clustered (%s) but tolerance %g needs Barnes-Hut theta %.2f > %.2f",
+			shape, tolerance, theta, maxTheta);
+	} else if (treeTime >= tuned.estimatedTime) {
+		engine = EngineFMM;
+		snprintf(text, sizeof(text), "clustered (%s) but Barnes-Hut at theta %.2f takes %.3g s against MLFMM %.3g s",
+			shape, theta, treeTime, tuned.estimatedTime);
+	} else {
+		engine = EngineBarnesHut;
+		snprintf(text, sizeof(text), "clustered: %s, Barnes-Hut %.3g s against MLFMM %.3g s",
+			shape, treeTime, tuned.estimatedTime);
+	}
+	reason = text;
+	return engine;
+}
+
+double Solver::CalibrateBarnesHut(const std::vector<Point*>& points, double& estimatedTime) const
+{
+	// a regular subsample keeps the shape of the clusters at a fraction of the cost
+	const int N = points.size(), samples = std::min(N, 4096);
+	std::vector<Point> sample;
+	sample.reserve(samples);
+	for (int index = 0; index < samples; index++)
+		sample.push_back(*points[(long)index * N / samples]);
+	BHNode tree(Complex(0.5, 0.5), Complex(0.5, 0.5), 0, 20);
+	BHNode coarse(Complex(0.5, 0.5), Complex(0.5, 0.5), 0, 20);
+	std::vector<Point*> targets, coarseTargets;
+	for (int index = 0; index < samples; index++) {
+		tree.AddSource(&sample[index]);
+		if (index % 4 == 0)
+			coarse.AddSource(&sample[index]);
+		if (index % std::max(1, samples / 64) == 0)
+			targets.push_back(&sample[index]);
+		if (index % std::max(4, samples / 16) == 0)
+			coarseTargets.push_back(&sample[index]);
+	}
+	tree.ComputeChargeDistribution();
+	coarse.ComputeChargeDistribution();
+
+	// fit error = C theta^-k through two opening parameters. A node is accepted at a distance d
+	// from its center of charge above theta times its half diagonal h, and about the center of
+	// charge the monopole error of one sign is the quadrupole term, at most h^2 / 2d^2 < 1/2theta^2
+	// per unit charge, so k >= 2 where the sample cannot tell.
+	const double low = 1.5, high = 3.0;
+	const double lowError = SampleError(tree, targets, low), highError = SampleError(tree, targets, high);
+	double order = 2.0;
+	if (highError > 0 && highError < lowError)
+		order = std::max(order, log(lowError / highError) / log(high / low));
+	const double theta = lowError > 0 ? std::max(1.0, low * pow(lowError / tolerance, 1.0 / order)) : 1.0;
+
+	// the time per target grows with the depth of the tree and with its cache misses; a power
+	// of the particle count through the sample and a quarter of it extrapolates both
+	const double time = TraversalTime(tree, targets, theta), coarseTime = TraversalTime(coarse, coarseTargets, theta);
+	const double growth = std::max(0.0, log(time / coarseTime) / log(4.0));
+	estimatedTime = N * time * pow((double)N / samples, growth);
+	return theta;
+}
+
+bool Solver::Solve(const std::vector<Point*>& points)
+{
+	for (auto &point : points) {
+		if (!(real(point->coord) >= 0 && real(point->coord) < 1 && imag(point->coord) >= 0 && imag(point->coord) < 1)) {
+			fprintf(stderr, "particle outside the unit square\n");
+			return false;
+		}
+	}
+	Choose(points);
+	if (engine == EngineBarnesHut) {
+		BHNode tree(Complex(0.5, 0.5), Complex(0.5, 0.5), 0, depth);
+		for (auto &point : points)
+			tree.AddSource(point);
+		BHNode::ResetFlops();
+		tree.ComputeChargeDistribution();
+		#pragma omp parallel for schedule(dynamic, 64)
+		for (int index = 0; index < points.size(); index++)
+			points[index]->potential = tree.ComputePotential(points[index], theta);
+		flops = BHNode::TotalFlops();
+		return true;
+	}
+	Potential potential(degree);
+	// the direct sum does not use the boxes, so the smallest tree will do
+	MLFMM tree(levels, potential);
+	for (auto &point : points) {
+		tree.AddSource(point);
+		tree.AddTarget(point);
+	}
+	if (engine == EngineFMM) {
+		tree.Solve();
+		flops = tree.flops;
+	} else {
+		tree.DirectSolve();
+		flops = (long)points.size() * (points.size() - 1) / 2;
+	}
+	return true;
+}
+
+const char* Solver::EngineName(const SolverEngine engine)
+{
+	switch (engine) {
+		case EngineDirect:    return "direct";
+		case EngineFMM:       return "fmm";
+		case EngineBarnesHut: return "bh";
+	}
+	return "unknown";
+}
+
+std::string Solver::Report() const
+{
+	char text[128];
+	if (engine == EngineFMM)
+		snprintf(text, sizeof(text), "fmm (levels %d, degree %d)", levels, degree);
+	else if (engine == EngineBarnesHut)
+		snprintf(text, sizeof(text), "bh (theta %.2f, depth %d)", theta, depth);
+	else
+		snprintf(text, sizeof(text), "direct");
+	return std::string(text) + ": " + reason;
+}
@@ -0,0 +1,113 @@
+#ifndef Solver_h
+#define Solver_h
+
+#include <string>
+#include "GeneralUtilities.h"
+#include "Point.h"
+#include "Tuner.h"
+
+/// Engines a Solver can choose from
+enum SolverEngine {
+	EngineDirect,
+	EngineFMM,
+	EngineBarnesHut
+};
+
+/// Cheap statistics of a particle set from its occupancy of the Morton-indexed leaves of one
+/// level of a quadtree, with about 16 particles per leaf if the particles were uniform
+struct ClusteringStatistics {
+	/// Level of the leaves
+	int level;
+	/// Fraction of the leaves without particles
+	double emptyFraction;
+	/// Mean number of particles of the occupied leaves
+	double occupiedMean;
+	/// Coefficient of variation of the number of particles of the occupied leaves: about
+	/// 1/sqrt(occupiedMean) for uniform particles, also for thin lines or rings, and large for
+	/// concentrated clusters
+	double occupiedVariation;
+	/// Number of particles of the fullest leaf
+	int maxOccupancy;
+	/// Whether there are charges of both signs
+	bool mixedCharges;
+
+	/// Measure a set of particles in the unit square
+	static ClusteringStatistics Measure(const std::vector<Point*>& points);
+};
+
+/// Front end choosing between direct summation, MLFMM and Barnes-Hut for the logarithmic
+/// potential of a set of particles, which are both the sources and the targets. Direct summation
+/// is used up to DirectLimit particles, Barnes-Hut for clusters of charges of one sign where its
+/// opening parameter for the tolerance, measured on a subsample, makes it faster than MLFMM, and
+/// MLFMM otherwise.
+class Solver {
+
+public:
+
+	/// Largest number of particles summed directly: MLFMM breaks even with the direct sum at
+	/// about 500 particles, and tuning would cost more than the sum below that
+	static const int DirectLimit = 512;
+
+	/// Accuracy target, as for Potential::DegreeForTolerance
+	double tolerance;
+
+	/// Variation of the occupied leaves above which the particles count as clustered
+	double clusterThreshold;
+
+	/// Fraction of empty leaves above which the particles count as clustered
+	double emptyThreshold;
+
+	/// Largest Barnes-Hut opening parameter considered
+	double maxTheta;
+
+	/// Engine chosen by the last Choose()
+	SolverEngine engine;
+
+	/// Why the engine was chosen
+	std::string reason;
+
+	/// Statistics of the last Choose()
+	ClusteringStatistics statistics;
+
+	/// MLFMM levels and truncation number
+	int levels, degree;
+
+	/// Barnes-Hut opening parameter, measured for the tolerance if the particles are clustered,
+	/// and maximum depth
+	double theta;
+	int depth;
+
+	/// Operation count of the last Solve()
+	long flops;
+
+	/// Constructor. The kernel timings of the cost model are measured on first use and kept in
+	/// memory; they are only read from and written to a cache file if a path is given, such as
+	/// Tuner::DefaultCachePath().
+	Solver(const double tolerance = 1.0e-6, const std::string& cachePath = "");
+
+	/// Choose the engine and its parameters for a set of particles
+	SolverEngine Choose(const std::vector<Point*>& points);
+
+	/// Choose the engine and store the potential of every particle due to all others in it.
+	/// Returns false if a particle is outside the unit square.
+	bool Solve(const std::vector<Point*>& points);
+
+	/// Name of an engine
+	static const char* EngineName(const SolverEngine engine);
+
+	/// One-line summary of the chosen engine, its parameters and the reason
+	std::string Report() const;
+
+private:
+
+	/// Cost model of MLFMM, calibrated on first use
+	Tuner tuner;
+
+	/// Smallest Barnes-Hut opening parameter meeting the tolerance, from the errors of two
+	/// opening parameters on a subsample of the particles, and the serial run time of Barnes-Hut
+	/// for all particles at that parameter, extrapolated from the subsample
+	double CalibrateBarnesHut(const std::vector<Point*>& points, double& estimatedTime) const;
+
+};
+
+#endif
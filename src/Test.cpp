@@ -1,22 +1,41 @@
 #include <cstdio>
+#include <memory>
+#include <string>
+#include <cstdlib>
+#include <unistd.h>
 #include "MLFMM.h"
 #include "BHNode.h"
-
-clock_t timer;
-void tic() { timer = clock(); }
-double toc() { return (double)(clock() - timer) / CLOCKS_PER_SEC + 0.001; }
+#include "Tuner.h"
+#include "Verification.h"
+#include "ParticleIO.h"
+#include "ChebyshevPotential.h"
+#include "Snapshot.h"
+#include "Solver.h"
+#include "Distributions.h"
+
+Timer timer;
+void tic() { timer.Start(); }
+double toc() { return timer.Elapsed(); }
+
+// a new empty file in /tmp unique to this process, for the caller to overwrite and unlink
+std::string TemporaryPath(const char* name) {
+    std::string path = std::string("/tmp/") + name + "-XXXXXX";
+    int descriptor = mkstemp(&path[0]);
+    if (descriptor >= 0)
+        close(descriptor);
+    return path;
+}
 
 void PrintFMMHeader() {
     printf("%3s %4s %8s %10s %10s %10s %10s %10s %10s\n", 
         "l", "p", "N", "FLOP", "t_direct", "t_FMM", "FLOPS", "Abs. Err", "Rel. Err");
 }
 
-void RunFMM(int levels, int degree, int N) 
+void RunFMM(int levels, const std::vector<int>& degrees, int N) 
 {
-    Potential coulomb(degree);
-    MLFMM tree(levels, coulomb);
+    Potential coulomb(degrees[levels - 1]);
+    MLFMM tree(levels, coulomb, degrees);
 
-    std::vector<Point*> sources(N);
     std::vector<Point*> targets(N);
     std::vector<double> exact(N, 0.0);
     std::vector<double> approx(N, 0.0);
@@ -24,12 +43,10 @@ void RunFMM(int levels, int degree, int N)
     double directTime = 0;
     double approxTime = 0;
 
+    // the same points as sources and targets, so that near-field pairs are evaluated once
     for (int index = 0; index < N; index++) {
-        double x = randf();
-        double y = randf();
-        sources[index] = new Point(Complex(x, y), index);
-        tree.AddSource(sources[index]);
-        targets[index] = new Point(Complex(x, y), index);
+        targets[index] = new Point(Complex(randf(), randf()), index);
+        tree.AddSource(targets[index]);
         tree.AddTarget(targets[index]);
     }
     
@@ -48,7 +65,7 @@ void RunFMM(int levels, int degree, int N)
     tree.MultipoleToMultipoleTranslation(); s2 = tree.flops; tree.flops = 0;
     tree.MultipoleToLocalTranslation(); s3 = tree.flops; tree.flops = 0; 
     tree.LocalToLocalTranslation(); s4 = tree.flops; tree.flops = 0;
-    tree.LocalExpansion(); s5 = tree.flops; tree.flops = 0;
+    tree.LocalExpansion(); tree.NearFieldInteraction(); s5 = tree.flops; tree.flops = 0;
     long sum = s1+s2+s3+s4+s5;
     printf("%ld %ld %ld %ld %ld %ld\n", s1, s2, s3, s4, s5, sum);
 
@@ -65,14 +82,17 @@ void RunFMM(int levels, int degree, int N)
     double relError = AvgRelError(exact, approx);
     double fps = (double)tree.flops / approxTime;
 
-    printf("%3d %4d %8d %10ld %10.3f %10.3f %10.2e %10.2e %10.2e\n", levels, degree, N, tree.flops, directTime, approxTime, fps, absError, relError);
+    printf("%3d %4d %8d %10ld %10.3f %10.3f %10.2e %10.2e %10.2e\n", levels, degrees[levels - 1], N, tree.flops, directTime, approxTime, fps, absError, relError);
     fflush(stdout);
 
     // clean up
-    for (int index = 0; index < N; index++){
-        delete sources[index];
+    for (int index = 0; index < N; index++)
         delete targets[index];
-    }
+}
+
+void RunFMM(int levels, int degree, int N) 
+{
+    RunFMM(levels, std::vector<int>(levels, degree), N);
 }
 
 void TestFMMPerformance() {
@@ -88,6 +108,287 @@ void TestFMMPerformance() {
     }
 }
 
+void TestFMMAutoTuned() {
+    PrintFMMHeader();
+    Tuner tuner;
+    double tolerance = 1.0e-4;
+    for (int i = 0; i < 31; i++) {
+        double exponent = (0.1 * i) + 2;
+        int N = round(pow(10, exponent));
+        TunedParameters tuned = tuner.Tune(N, tolerance);
+        RunFMM(tuned.levels, tuned.degree, N);
+    }
+}
+
+void TestFMMVariableDegree() {
+    PrintFMMHeader();
+    int N = 16384;
+    int levels = 7;
+    for (int i = 2; i <= 10; i++) {
+        double tolerance = pow(10.0, -i);
+        RunFMM(levels, Potential::DegreeForTolerance(tolerance), N);
+        RunFMM(levels, Tuner::SelectDegrees(levels, N, tolerance), N);
+    }
+}
+
+void RunFMMSampled(int levels, int degree, int N, int samples) 
+{
+    Potential coulomb(degree);
+    MLFMM tree(levels, coulomb);
+
+    std::vector<Point*> points(N);
+    for (int index = 0; index < N; index++) {
+        points[index] = new Point(Complex(randf(), randf()), index);
+        tree.AddSource(points[index]);
+        tree.AddTarget(points[index]);
+    }
+
+    tic();
+    tree.Solve();
+    double approxTime = toc();
+
+    // stratify over a level coarse enough to leave several samples per box
+    int strataLevel = std::max(1, std::min(levels - 1, (int)floor(log(samples / 10.0) / log(4.0))));
+    tic();
+    SampledError error = VerifySampled(points, points, coulomb, samples, N, strataLevel);
+    double verifyTime = toc();
+
+    // the sample must be stratified and of exactly the requested size
+    bool stratified = error.strata == (1 << (2 * strataLevel)) && error.samples == samples;
+    printf("%3d %4d %9d %10.3f %10.3f %10.2e %10.2e %10.2e %10.2e %6d %6s\n", levels, degree, N, approxTime, verifyTime,
+        error.avgAbsError, error.avgAbsErrorCI, error.avgRelError, error.maxRelError, error.strata, stratified ? "yes" : "NO");
+    fflush(stdout);
+
+    for (int index = 0; index < N; index++)
+        delete points[index];
+}
+
+void TestFMMLargeN() {
+    printf("%3s %4s %9s %10s %10s %10s %10s %10s %10s %6s %6s\n", 
+        "l", "p", "N", "t_FMM", "t_verify", "Abs. Err", "+-", "Rel. Err", "Max Rel.", "strata", "pass");
+    for (int i = 0; i < 5; i++) {
+        int N = round(pow(10, 4 + 0.5 * i));
+        int levels = std::max(3, (int)round(log((double)N) / log(4.0)));
+        RunFMMSampled(levels, 10, N, 1000);
+    }
+}
+
+void TestFMMParticleFile() {
+    const int N = 100000, levels = 7, degree = 10;
+    const std::string input = TemporaryPath("hnbody-particles");
+    const std::string output = TemporaryPath("hnbody-potentials");
+    std::vector<double> x(N), y(N), q(N);
+    for (int i = 0; i < N; i++) {
+        x[i] = randf();
+        y[i] = randf();
+        q[i] = (i % 2) ? 1.0 : -1.0;
+    }
+    ParticleFile::Write(input, N, x.data(), y.data(), q.data());
+
+    ParticleFile file;
+    Potential coulomb(degree);
+    MLFMM tree(levels, coulomb);
+    tic();
+    bool loaded = file.Open(input) && tree.AddParticles(file, 1 << 14);
+    unlink(input.c_str());
+    if (!loaded) {
+        unlink(output.c_str());
+        return;
+    }
+    double loadTime = toc();
+    tic();
+    tree.Solve();
+    double approxTime = toc();
+    PotentialFile potentials;
+    potentials.Create(output, N);
+    potentials.Store(tree.targets);
+    potentials.Close();
+
+    // read the potentials back by file row and compare with the solve
+    potentials.Open(output);
+    double maxDifference = 0;
+    for (auto &target : tree.targets)
+        maxDifference = std::max(maxDifference, fabs(potentials.potential[target->index] - target->potential));
+    unlink(output.c_str());
+    SampledError error = VerifySampled(tree.sources, tree.targets, coulomb, 1000, 1);
+    printf("%8s %10s %10s %10s %10s\n", "N", "t_load", "t_FMM", "Rel. Err", "Roundtrip");
+    printf("%8d %10.3f %10.3f %10.2e %10.2e\n", N, loadTime, approxTime, error.avgRelError, maxDifference);
+}
+
+void TestFMMPeriodic() {
+    // the degree comes from the tolerance as in the tuner; the periodic error relative to the
+    // largest potential must meet the tolerance like the free-space error does
+    const int N = 20000, levels = 6;
+    const double tolerances[] = { 1.0e-3, 1.0e-5, 1.0e-7 };
+    printf("%8s %8s %6s %10s %10s %12s %10s %10s %10s %6s\n", "charges", "tol", "degree", "mode", "t_FMM", "flops", "Avg Err", "Max Err", "Rel Err", "pass");
+    for (int neutral = 1; neutral >= 0; neutral--) {
+        std::vector<Point> points;
+        points.reserve(N);
+        for (int i = 0; i < N; i++)
+            points.push_back(Point(Complex(randf(), randf()), i, (neutral && i % 2) ? -1.0 : 1.0));
+        for (auto &tolerance : tolerances) {
+            const int degree = Potential::DegreeForTolerance(tolerance);
+            for (int periodic = 0; periodic <= 1; periodic++) {
+                Potential coulomb(degree);
+                MLFMM tree(levels, coulomb);
+                tree.periodic = periodic;
+                tree.neutralityWarned = true;
+                for (auto &point : points) {
+                    tree.AddSource(&point);
+                    tree.AddTarget(&point);
+                }
+                tic();
+                tree.Solve();
+                double approxTime = toc();
+                SampledError error = VerifySampled(tree.sources, tree.targets, coulomb, 200, 1, 0, periodic);
+                double scale = 0;
+                for (auto &point : points)
+                    scale = std::max(scale, fabs(point.potential));
+                double relative = error.maxAbsError / scale;
+                printf("%8s %8.0e %6d %10s %10.3f %12ld %10.2e %10.2e %10.2e %6s\n", neutral ? "neutral" : "charged",
+                    tolerance, degree, periodic ? "periodic" : "free", approxTime, tree.flops, error.avgAbsError,
+                    error.maxAbsError, relative, relative <= tolerance ? "yes" : "NO");
+            }
+        }
+    }
+}
+
+void TestFMMKernels() {
+    const int N = 20000, levels = 6;
+    LogKernel logarithm;
+    YukawaKernel yukawa(20.0);
+    GaussianKernel gaussian(0.1);
+    const Kernel* kernels[] = { &logarithm, &yukawa, &gaussian };
+    std::vector<Point> points;
+    points.reserve(N);
+    for (int i = 0; i < N; i++)
+        points.push_back(Point(Complex(randf(), randf()), i, (i % 2) ? -1.0 : 1.0));
+    printf("%10s %6s %10s %10s %10s\n", "kernel", "nodes", "t_setup", "t_FMM", "Rel. Err");
+    for (auto &kernel : kernels) {
+        for (int nodes = 4; nodes <= 10; nodes += 3) {
+            ChebyshevPotential potential(*kernel, nodes);
+            tic();
+            MLFMM tree(levels, potential);
+            double setupTime = toc();
+            for (auto &point : points) {
+                tree.AddSource(&point);
+                tree.AddTarget(&point);
+            }
+            tic();
+            tree.Solve();
+            double approxTime = toc();
+            SampledError error = VerifySampled(tree.sources, tree.targets, potential, 200, 1);
+            printf("%10s %6d %10.3f %10.3f %10.2e\n", kernel->Name(), nodes, setupTime, approxTime, error.avgRelError);
+        }
+    }
+    // the analytic expansions of the log kernel for reference
+    Potential coulomb(Potential::DegreeForTolerance(1e-8));
+    MLFMM tree(levels, coulomb);
+    for (auto &point : points) {
+        tree.AddSource(&point);
+        tree.AddTarget(&point);
+    }
+    tic();
+    tree.Solve();
+    double approxTime = toc();
+    SampledError error = VerifySampled(tree.sources, tree.targets, coulomb, 200, 1);
+    printf("%10s %6s %10.3f %10.3f %10.2e\n", "analytic", "-", 0.0, approxTime, error.avgRelError);
+}
+
+void TestFMMSnapshot() {
+    const int N = 200000, levels = 8, queries = 10000;
+    const std::string path = TemporaryPath("hnbody-snapshot");
+    LogKernel logarithm;
+    Potential coulomb(12);
+    ChebyshevPotential chebyshev(logarithm, 6);
+    Potential* potentials[] = { &coulomb, &chebyshev };
+    std::vector<Point> points;
+    points.reserve(N);
+    for (int i = 0; i < N; i++)
+        points.push_back(Point(Complex(randf(), randf()), i, (i % 2) ? -1.0 : 1.0));
+    std::vector<Complex> probes(queries);
+    for (auto &probe : probes)
+        probe = Complex(randf(), randf());
+    printf("%10s %10s %10s %10s %10s %10s\n", "potential", "t_build", "t_save", "t_restore", "Roundtrip", "Probe Err");
+    for (auto &potential : potentials) {
+        tic();
+        MLFMM tree(levels, *potential);
+        for (auto &point : points) {
+            tree.AddSource(&point);
+            tree.AddTarget(&point);
+        }
+        tree.Solve();
+        double buildTime = toc();
+        tic();
+        SnapshotFile::Write(path, tree);
+        double saveTime = toc();
+
+        // a query-only tree from the snapshot, with a fresh potential of the same kind
+        tic();
+        SnapshotFile snapshot;
+        std::unique_ptr<Potential> restoredPotential(potential->IsAnalytic() ? new Potential(12) : new ChebyshevPotential(logarithm, 6));
+        if (!snapshot.Open(path) || !snapshot.LoadOperators(*restoredPotential))
+            break;
+        MLFMM restored(levels, *restoredPotential);
+        if (!restored.Restore(snapshot))
+            break;
+        double restoreTime = toc();
+
+        double roundtrip = 0;
+        for (auto &target : restored.targets)
+            roundtrip = std::max(roundtrip, fabs(target->potential - points[target->index].potential));
+        for (int i = 0; i < queries; i++) {
+            double restoredValue = 0, treeValue = 0;
+            restored.Evaluate(probes[i], restoredValue);
+            tree.Evaluate(probes[i], treeValue);
+            roundtrip = std::max(roundtrip, fabs(restoredValue - treeValue));
+        }
+        // probes against direct sums
+        double error = 0, scale = 0;
+        for (int i = 0; i < 100; i++) {
+            double exact = 0;
+            for (auto &point : points)
+                exact += point.charge * potential->DirectEvaluate(probes[i], point.coord);
+            double value = 0;
+            restored.Evaluate(probes[i], value);
+            error = std::max(error, fabs(value - exact));
+            scale = std::max(scale, fabs(exact));
+        }
+        printf("%10s %10.3f %10.3f %10.3f %10.2e %10.2e\n", potential->IsAnalytic() ? "analytic" : "chebyshev",
+            buildTime, saveTime, restoreTime, roundtrip, error / scale);
+    }
+    unlink(path.c_str());
+}
+
+void TestSolver() {
+    const char* distributions[] = { "uniform", "plummer", "line", "ring" };
+    const int sizes[] = { 500, 20000, 200000 };
+    const double tolerances[] = { 1.0e-4, 1.0e-6 };
+    Potential coulomb(0);
+    printf("%10s %8s %8s %8s %10s %10s  %s\n", "dist", "N", "tol", "engine", "time", "Rel Err", "reason");
+    for (auto &distribution : distributions) {
+        for (auto &N : sizes) {
+            Coordinates coords = GenerateDistribution(distribution, N, 1);
+            std::vector<Point> storage;
+            std::vector<Point*> points;
+            storage.reserve(N);
+            for (int i = 0; i < N; i++) {
+                storage.push_back(Point(coords[i], i));
+                points.push_back(&storage.back());
+            }
+            for (auto &tolerance : tolerances) {
+                Solver solver(tolerance);
+                tic();
+                solver.Solve(points);
+                double time = toc();
+                SampledError error = VerifySampled(points, points, coulomb, 100, 1);
+                printf("%10s %8d %8.0e %8s %10.3f %10.2e  %s\n", distribution, N, tolerance,
+                    Solver::EngineName(solver.engine), time, error.avgRelError, solver.reason.c_str());
+            }
+        }
+    }
+}
+
 void TestFMMScaling() {
     PrintFMMHeader();
     for (int i = 0; i < 31; i++) {
@@ -117,7 +418,6 @@ void TestDelicious() {
     RunFMM(5, 6, 4096);
 }
 
-long BHNode::flops = 0; 
 void RunBH(int maxDepth, int N, double theta) {
 
     BHNode tree(Complex(0.5, 0.5), Complex(0.5, 0.5), 0, maxDepth);
@@ -155,7 +455,7 @@ void RunBH(int maxDepth, int N, double theta) {
     approxTime = toc();
 
     double error = AvgAbsError(exact, approx);
-    double FLOPS = (double)BHNode::flops / (approxTime + 0.001);
+    double FLOPS = (double)BHNode::flops / approxTime;
     double speedup = (double)N * N / BHNode::flops;
     printf("%8d %5d %5.2f %10ld %10.3f %10.3f %10.3f %10.2e %10.2e\n",
         N, maxDepth, theta, BHNode::flops, speedup, directTime, approxTime, FLOPS, error);
@@ -195,8 +495,52 @@ void TestBHTheta() {
     }
 }
 
+struct NamedTest {
+    const char* name;
+    void (*run)();
+};
+
+const NamedTest tests[] = {
+    { "TestFMMPerformance", TestFMMPerformance },
+    { "TestFMMAutoTuned", TestFMMAutoTuned },
+    { "TestFMMVariableDegree", TestFMMVariableDegree },
+    { "TestFMMLargeN", TestFMMLargeN },
+    { "TestFMMParticleFile", TestFMMParticleFile },
+    { "TestFMMPeriodic", TestFMMPeriodic },
+    { "TestFMMKernels", TestFMMKernels },
+    { "TestFMMSnapshot", TestFMMSnapshot },
+    { "TestSolver", TestSolver },
+    { "TestFMMScaling", TestFMMScaling },
+    { "TestFMMLevels", TestFMMLevels },
+    { "TestDelicious", TestDelicious },
+    { "TestBHN", TestBHN },
+    { "TestBHTheta", TestBHTheta },
+};
+
+// runs the tests named on the command line in order, "all" for every test, TestBHTheta without arguments
 int main(int argc, char** argv) 
 {
-    TestBHTheta();
+    if (argc < 2) {
+        TestBHTheta();
+        return 0;
+    }
+    for (int arg = 1; arg < argc; arg++) {
+        std::string name(argv[arg]);
+        bool found = false;
+        for (auto &test : tests) {
+            if (name == "all" || name == test.name) {
+                printf("# %s\n", test.name);
+                test.run();
+                found = true;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "unknown test %s, one of: all", argv[arg]);
+            for (auto &test : tests)
+                fprintf(stderr, " %s", test.name);
+            fprintf(stderr, "\n");
+            return 1;
+        }
+    }
     return 0;
 }
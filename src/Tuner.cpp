@@ -0,0 +1,306 @@
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "Tuner.h"
+#include "MLFMM.h"
+
+Tuner::Tuner(const std::string& cachePath)
+: cachePath(cachePath), p2pTime(0), minLevels(3), maxLevels(11)
+{
+	char hostname[256] = "unknown";
+	gethostname(hostname, sizeof(hostname) - 1);
+	host = hostname;
+	LoadCalibration();
+}
+
+std::string Tuner::DefaultCachePath()
+{
+	const char* home = getenv("HOME");
+	return std::string(home ? home : ".") + "/.hnbody-tuning";
+}
+
+TunedParameters Tuner::Tune(const int N, const double tolerance)
+{
+	std::vector<std::vector<double>> histograms(maxLevels);
+	for (int level = 0; level < maxLevels; level++)
+		histograms[level].resize((int)pow(4, level), (double)N / pow(4, level));
+	return Tune(histograms, Potential::DegreeForTolerance(tolerance));
+}
+
+TunedParameters Tuner::Tune(const std::vector<Point*>& points, const double tolerance)
+{
+	// bin at the deepest candidate leaf level, then aggregate towards the root
+	std::vector<std::vector<double>> histograms(maxLevels);
+	int deepest = maxLevels - 1;
+	histograms[deepest].resize((int)pow(4, deepest), 0.0);
+	for (auto &point : points) {
+		int x = (int)floor(real(point->coord) * pow(2, deepest));
+		int y = (int)floor(imag(point->coord) * pow(2, deepest));
+		histograms[deepest][interleave(x, y, deepest)] += 1.0;
+	}
+	for (int level = deepest - 1; level >= 0; level--) {
+		histograms[level].resize((int)pow(4, level), 0.0);
+		for (int index = 0; index < histograms[level + 1].size(); index++)
+			histograms[level][index >> 2] += histograms[level + 1][index];
+	}
+	return Tune(histograms, Potential::DegreeForTolerance(tolerance));
+}
+
+TunedParameters Tuner::Tune(const std::vector<std::vector<double>>& histograms, const int degree)
+{
+	Calibrate(degree);
+	TunedParameters best = { minLevels, degree, HUGE_VAL };
+	for (int levels = minLevels; levels <= maxLevels; levels++) {
+		double time = EstimateTime(levels, degree, histograms[levels - 1]);
+		if (time < best.estimatedTime) {
+			best.levels = levels;
+			best.estimatedTime = time;
+		}
+	}
+	return best;
+}
+
+std::vector<int> Tuner::SelectDegrees(const int levels, const int N, const double tolerance)
+{
+	// The far field of a target is split over the interaction lists of its ancestors.
+	// A box at level l holds a 4^-l share of the charge, so its truncation error is
+	// weighted accordingly; the weights are normalized such that a uniform degree
+	// reproduces Potential::TruncationError.
+	int maxLevel = levels - 1;
+	std::vector<double> weight(levels, 0.0), cost(levels, 0.0);
+	double totalWeight = 0;
+	for (int level = 2; level <= maxLevel; level++) {
+		weight[level] = pow(4.0, -level);
+		totalWeight += weight[level];
+		cost[level] = Translations(level);
+	}
+	for (int level = 2; level <= maxLevel; level++)
+		weight[level] /= totalWeight;
+	auto flops = [&](const int level, const int degree) {
+		// translations are degree^2, P2M and L2P at the leaves are degree per particle
+		return cost[level] * degree * degree + (level == maxLevel ? 2.0 * N * degree : 0.0);
+	};
+
+	std::vector<int> degrees(levels, Potential::DegreeForTolerance(tolerance));
+	double error = Potential::TruncationError(degrees[maxLevel]);
+
+	// greedily drop the term that saves the most flops per unit of added error,
+	// keeping degrees non-increasing towards the leaves so that M2M never truncates
+	while (true) {
+		int best = -1;
+		double bestRatio = 0;
+		for (int level = 2; level <= maxLevel; level++) {
+			int degree = degrees[level];
+			if (degree <= 2 || (level < maxLevel && degree - 1 < degrees[level + 1]))
+				continue;
+			double addedError = weight[level] * (Potential::TruncationError(degree - 1) - Potential::TruncationError(degree));
+			if (error + addedError > tolerance)
+				continue;
+			double ratio = (flops(level, degree) - flops(level, degree - 1)) / addedError;
+			if (ratio > bestRatio) {
+				best = level;
+				bestRatio = ratio;
+			}
+		}
+		if (best < 0)
+			break;
+		error += weight[best] * (Potential::TruncationError(degrees[best] - 1) - Potential::TruncationError(degrees[best]));
+		degrees[best]--;
+	}
+
+	// the root levels only relay multipoles and locals in free space
+	for (int level = 0; level < std::min(2, levels); level++)
+		degrees[level] = degrees[std::min(2, maxLevel)];
+	return degrees;
+}
+
+double Tuner::EstimateTime(const int levels, const int degree, const std::vector<double>& leafCounts)
+{
+	Calibrate(degree);
+	int maxLevel = levels - 1;
+	int n = 1 << maxLevel;
+
+	// near field: every particle against its own box and the 8 neighbors, each pair once
+	double particles = 0, pairs = 0;
+	for (int index = 0; index < leafCounts.size(); index++) {
+		if (leafCounts[index] == 0)
+			continue;
+		Complex location = uninterleave(index, maxLevel);
+		int x = (int)real(location);
+		int y = (int)imag(location);
+		double nearby = leafCounts[index] - 1;
+		for (int i = -1; i <= 1; i++)
+			for (int j = -1; j <= 1; j++)
+				if ((i != 0 || j != 0) && x + i >= 0 && y + j >= 0 && x + i < n && y + j < n)
+					nearby += leafCounts[interleave(x + i, y + j, maxLevel)];
+		particles += leafCounts[index];
+		pairs += leafCounts[index] * nearby;
+	}
+
+	double translations = 0;
+	for (int level = 2; level <= maxLevel; level++)
+		translations += Translations(level);
+
+	return 0.5 * pairs * p2pTime + translations * m2lTime[degree] + 2.0 * particles * expansionTime[degree];
+}
+
+double Tuner::Translations(const int level)
+{
+	// interaction lists are children of the parent's neighbors that are not neighbors,
+	// which factorizes into per-dimension stencil widths
+	int boxes = 1 << level;
+	double parentStencil = 0, ownStencil = 0;
+	for (int x = 0; x < boxes; x++) {
+		parentStencil += std::min(boxes - 1, 2 * ((x >> 1) + 1) + 1) - std::max(0, 2 * ((x >> 1) - 1)) + 1;
+		ownStencil += std::min(boxes - 1, x + 1) - std::max(0, x - 1) + 1;
+	}
+	// plus one M2M and one L2L per box
+	return parentStencil * parentStencil - ownStencil * ownStencil + 2.0 * boxes * boxes;
+}
+
+void Tuner::Calibrate(const int degree)
+{
+	if (m2lTime.size() <= degree) {
+		m2lTime.resize(degree + 1, 0.0);
+		expansionTime.resize(degree + 1, 0.0);
+	}
+	if (p2pTime > 0 && m2lTime[degree] > 0 && expansionTime[degree] > 0)
+		return;
+	if (p2pTime <= 0)
+		p2pTime = MeasureP2P();
+	if (m2lTime[degree] <= 0)
+		m2lTime[degree] = MeasureM2L(degree);
+	if (expansionTime[degree] <= 0)
+		expansionTime[degree] = MeasureExpansion(degree);
+	SaveCalibration();
+}
+
+bool Tuner::LoadCalibration()
+{
+	if (cachePath.empty())
+		return false;
+	FILE* file = fopen(cachePath.c_str(), "r");
+	if (!file)
+		return false;
+	char key[64], value[256];
+	bool sameHost = false;
+	int version = 0;
+	while (fscanf(file, "%63s", key) == 1) {
+		std::string name(key);
+		int degree;
+		double seconds;
+		if (name == "host" && fscanf(file, "%255s", value) == 1) {
+			sameHost = (host == value);
+		} else if (name == "version" && fscanf(file, "%d", &version) == 1) {
+			continue;
+		} else if (name == "p2p" && fscanf(file, "%lf", &seconds) == 1) {
+			p2pTime = seconds;
+		} else if ((name == "m2l" || name == "expansion") && fscanf(file, "%d %lf", &degree, &seconds) == 2) {
+			if (m2lTime.size() <= degree) {
+				m2lTime.resize(degree + 1, 0.0);
+				expansionTime.resize(degree + 1, 0.0);
+			}
+			(name == "m2l" ? m2lTime : expansionTime)[degree] = seconds;
+		} else {
+			break;
+		}
+	}
+	fclose(file);
+	if (!sameHost || version != KernelVersion) {
+		// timings from another machine or of older kernels are worse than none
+		p2pTime = 0;
+		m2lTime.clear();
+		expansionTime.clear();
+	}
+	return sameHost && version == KernelVersion;
+}
+
+void Tuner::SaveCalibration()
+{
+	if (cachePath.empty())
+		return;
+	FILE* file = fopen(cachePath.c_str(), "w");
+	if (!file) {
+		fprintf(stderr, "Tuner: cannot write calibration cache %s\n", cachePath.c_str());
+		return;
+	}
+	fprintf(file, "host %s\n", host.c_str());
+	fprintf(file, "version %d\n", KernelVersion);
+	fprintf(file, "p2p %.6e\n", p2pTime);
+	for (int degree = 0; degree < m2lTime.size(); degree++) {
+		if (m2lTime[degree] > 0)
+			fprintf(file, "m2l %d %.6e\n", degree, m2lTime[degree]);
+		if (expansionTime[degree] > 0)
+			fprintf(file, "expansion %d %.6e\n", degree, expansionTime[degree]);
+	}
+	fclose(file);
+}
+
+/// Seconds per call of a kernel, best of several runs of at least 10ms each
+template <typename Kernel>
+static double TimeKernel(Kernel kernel)
+{
+	Timer timer;
+	double best = HUGE_VAL;
+	for (int trial = 0; trial < 5; trial++) {
+		long calls = 0;
+		double elapsed = 0;
+		timer.Start();
+		do {
+			kernel();
+			calls++;
+			elapsed = timer.Elapsed();
+		} while (elapsed < 0.01);
+		best = std::min(best, elapsed / calls);
+	}
+	return best;
+}
+
+double Tuner::MeasureP2P()
+{
+	const int n = 256;
+	Potential potential(2);
+	std::vector<double> x(n), y(n), q(n, 1.0), potentials(n, 0.0);
+	for (int i = 0; i < n; i++) {
+		x[i] = randf() * 0.05;
+		y[i] = randf() * 0.05;
+	}
+	double seconds = TimeKernel([&]() {
+		potential.EvaluateDirectSelf(x.data(), y.data(), q.data(), n, potentials.data());
+	});
+	// every pair was evaluated once for both particles
+	return seconds / (n * (n - 1) / 2);
+}
+
+double Tuner::MeasureM2L(const int degree)
+{
+	// one translation between two well-separated boxes, serially like the other kernels; the
+	// M2M and L2L translations are of the same order and counted at the same cost
+	const int level = 3;
+	Potential potential(degree);
+	Box source(level, interleave(0, 0, level), degree), target(level, interleave(2, 3, level), degree);
+	for (auto &coefficient : source.externalMultipoleCoeffs)
+		coefficient = Complex(randf(), randf());
+	double seconds = TimeKernel([&]() {
+		potential.BoxMultipoleToLocal(&source, &target, Complex(0, 0));
+	});
+	return seconds;
+}
+
+double Tuner::MeasureExpansion(const int degree)
+{
+	const int n = 64;
+	Potential potential(degree);
+	std::vector<double> x(n), y(n), q(n, 1.0), potentials(n, 0.0);
+	for (int i = 0; i < n; i++) {
+		x[i] = randf() * 0.125;
+		y[i] = randf() * 0.125;
+	}
+	ComplexVec coeffs(degree, Complex(0, 0));
+	double seconds = TimeKernel([&]() {
+		potential.MultipoleExpansion(x.data(), y.data(), q.data(), n, Complex(0.0625, 0.0625), coeffs);
+		potential.EvaluateLocal(x.data(), y.data(), n, Complex(0.0625, 0.0625), coeffs, potentials.data());
+	});
+	// one P2M and one L2P per particle were timed
+	return seconds / (2 * n);
+}
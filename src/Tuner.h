@@ -0,0 +1,94 @@
+#ifndef Tuner_h
+#define Tuner_h
+
+#include <string>
+#include "GeneralUtilities.h"
+#include "Point.h"
+#include "FMMPotential.h"
+
+/// Tree depth and truncation number chosen by the tuner
+struct TunedParameters {
+	/// Number of levels in the tree
+	int levels;
+	/// Truncation number
+	int degree;
+	/// Modelled run time of MLFMM::Solve() in seconds
+	double estimatedTime;
+};
+
+/// Automatic selection of MLFMM parameters from a calibrated cost model
+class Tuner {
+
+public:
+
+	/// Revision of the timed kernels, cached calibrations of other revisions are discarded
+	static const int KernelVersion = 5;
+
+	/// Path of the on-disk calibration cache, empty to keep the calibration in memory
+	std::string cachePath;
+
+	/// Host the calibration was measured on
+	std::string host;
+
+	/// Seconds per near-field (P2P) pair interaction, evaluated once for both particles
+	double p2pTime;
+
+	/// Seconds per M2L, M2M or L2L translation, indexed by degree (0 if not calibrated)
+	std::vector<double> m2lTime;
+
+	/// Seconds per particle for a P2M or L2P expansion, indexed by degree (0 if not calibrated)
+	std::vector<double> expansionTime;
+
+	/// Shallowest tree considered
+	int minLevels;
+
+	/// Deepest tree considered
+	int maxLevels;
+
+	/// Constructor, reads the calibration cache if it exists
+	Tuner(const std::string& cachePath = DefaultCachePath());
+
+	/// Default cache location, $HOME/.hnbody-tuning
+	static std::string DefaultCachePath();
+
+	/// Choose levels and degree for N uniformly distributed particles
+	TunedParameters Tune(const int N, const double tolerance);
+
+	/// Choose levels and degree for a given set of particles
+	TunedParameters Tune(const std::vector<Point*>& points, const double tolerance);
+
+	/// Truncation number per level meeting a tolerance with the fewest flops
+	static std::vector<int> SelectDegrees(const int levels, const int N, const double tolerance);
+
+	/// Modelled run time of MLFMM::Solve() for the given leaf occupancy
+	double EstimateTime(const int levels, const int degree, const std::vector<double>& leafCounts);
+
+	/// Make sure the kernels needed for a degree are calibrated, measuring them if not
+	void Calibrate(const int degree);
+
+	/// Read the calibration cache, returns false if missing, stale or measured on another host
+	bool LoadCalibration();
+
+	/// Write the calibration cache
+	void SaveCalibration();
+
+	/// Number of M2L, M2M and L2L translations at a level of the tree
+	static double Translations(const int level);
+
+private:
+
+	/// Choose levels for a degree from leaf occupancy histograms, indexed by level
+	TunedParameters Tune(const std::vector<std::vector<double>>& histograms, const int degree);
+
+	/// Measure the P2P kernel
+	double MeasureP2P();
+
+	/// Measure one M2L translation, serially
+	double MeasureM2L(const int degree);
+
+	/// Measure the P2M and L2P kernels
+	double MeasureExpansion(const int degree);
+
+};
+
+#endif
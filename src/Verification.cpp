@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <map>
+#include "Verification.h"
+
+/// Running sums of an error metric within one stratum
+struct StratumSums {
+	double abs, abs2, rel, rel2;
+	int count;
+};
+
+/// Exponential integral E1(x) for x > 0
+static double ExponentialIntegral(const double x)
+{
+	const double euler = 0.5772156649015329;
+	if (x <= 1) {
+		double sum = -euler - log(x), term = 1;
+		for (int k = 1; k < 40; k++) {
+			term *= -x / k;
+			sum -= term / k;
+		}
+		return sum;
+	}
+	// continued fraction by the modified Lentz method
+	double b = x + 1, c = 1e300, d = 1 / b, h = d;
+	for (int k = 1; k < 200; k++) {
+		double a = -(double)k * k;
+		b += 2;
+		d = 1 / (a * d + b);
+		c = b + a / c;
+		double delta = c * d;
+		h *= delta;
+		if (fabs(delta - 1) < 1e-16)
+			break;
+	}
+	return h * exp(-x);
+}
+
+/// Ewald splitting parameter of the unit square and number of reciprocal vectors per direction
+static const double ewaldAlpha = 30;
+static const int ewaldModes = 11;
+
+/// Structure factors S(k) = sum of q exp(-i k.z) over the sources for k = 2 pi (mx, my), |mx|, |my| <= ewaldModes
+static std::vector<Complex> StructureFactors(const std::vector<Point*>& sources)
+{
+	const int width = 2 * ewaldModes + 1;
+	std::vector<Complex> factors(width * width, Complex(0, 0));
+	std::vector<Complex> powersX(width), powersY(width);
+	for (auto &source : sources) {
+		Complex ex = exp(Complex(0, -2 * M_PI * real(source->coord)));
+		Complex ey = exp(Complex(0, -2 * M_PI * imag(source->coord)));
+		powersX[ewaldModes] = powersY[ewaldModes] = 1;
+		for (int m = 1; m <= ewaldModes; m++) {
+			powersX[ewaldModes + m] = powersX[ewaldModes + m - 1] * ex;
+			powersX[ewaldModes - m] = conj(powersX[ewaldModes + m]);
+			powersY[ewaldModes + m] = powersY[ewaldModes + m - 1] * ey;
+			powersY[ewaldModes - m] = conj(powersY[ewaldModes + m]);
+		}
+		for (int i = 0; i < width; i++)
+			for (int j = 0; j < width; j++)
+				factors[i * width + j] += source->charge * powersX[i] * powersY[j];
+	}
+	return factors;
+}
+
+/// Periodic potential at a target by Ewald summation, up to a constant
+static double EwaldPotential(const Point* target, const std::vector<Point*>& sources, const std::vector<Complex>& factors)
+{
+	const int width = 2 * ewaldModes + 1;
+	// real space: the short-range part -E1(alpha r^2) / 2 of log r, negligible beyond alpha r^2 = 40
+	double sum = 0;
+	for (auto &source : sources) {
+		double dx = real(target->coord) - real(source->coord);
+		double dy = imag(target->coord) - imag(source->coord);
+		dx -= round(dx);
+		dy -= round(dy);
+		for (int i = -1; i <= 1; i++) {
+			for (int j = -1; j <= 1; j++) {
+				double r2 = (dx + i) * (dx + i) + (dy + j) * (dy + j);
+				if (r2 == 0 || ewaldAlpha * r2 > 40)
+					continue;
+				sum -= 0.5 * source->charge * ExponentialIntegral(ewaldAlpha * r2);
+			}
+		}
+	}
+	// reciprocal space: the smooth part has the transform -2 pi exp(-k^2 / 4 alpha) / k^2
+	for (int i = 0; i < width; i++) {
+		for (int j = 0; j < width; j++) {
+			if (i == ewaldModes && j == ewaldModes)
+				continue;
+			double kx = 2 * M_PI * (i - ewaldModes), ky = 2 * M_PI * (j - ewaldModes);
+			double k2 = kx * kx + ky * ky;
+			Complex phase = exp(Complex(0, kx * real(target->coord) + ky * imag(target->coord)));
+			sum -= 2 * M_PI * exp(-k2 / (4 * ewaldAlpha)) / k2 * real(factors[i * width + j] * phase);
+		}
+	}
+	// the reciprocal sum includes the smooth part of the target's own charge, whose value at r = 0 is -(gamma + log alpha) / 2
+	const double euler = 0.5772156649015329;
+	sum += 0.5 * target->charge * (euler + log(ewaldAlpha));
+	return sum;
+}
+
+SampledError VerifySampled(const std::vector<Point*>& sources, const std::vector<Point*>& targets,
+	Potential& potential, const int samples, const unsigned seed, const int strataLevel, const bool periodic)
+{
+	int N = targets.size();
+	int n = std::min(samples, N);
+	std::mt19937 rng(seed);
+
+	// group targets into strata by the box that contains them
+	std::vector<std::vector<int>> strata;
+	if (strataLevel > 0) {
+		std::map<int, int> strataOfBox;
+		double scale = pow(2, strataLevel);
+		for (int index = 0; index < N; index++) {
+			Complex coord = targets[index]->coord;
+			int box = interleave((int)floor(real(coord) * scale), (int)floor(imag(coord) * scale), strataLevel);
+			if (strataOfBox.count(box) == 0) {
+				strataOfBox[box] = strata.size();
+				strata.push_back(std::vector<int>());
+			}
+			strata[strataOfBox[box]].push_back(index);
+		}
+	}
+	if (strata.empty() || strata.size() > n) {
+		// one stratum per sample at least, otherwise fall back to simple random sampling
+		strata.assign(1, std::vector<int>(N));
+		for (int index = 0; index < N; index++)
+			strata[0][index] = index;
+	}
+
+	// one sample per stratum and the rest in proportion to the stratum sizes, rounded by largest
+	// remainder so that exactly n are drawn; remainders skip strata that are already exhausted
+	int H = strata.size(), rest = n - H, assigned = 0;
+	std::vector<int> takes(H);
+	std::vector<std::pair<double, int>> remainders(H);
+	for (int h = 0; h < H; h++) {
+		double share = (double)rest * strata[h].size() / N;
+		takes[h] = 1 + (int)floor(share);
+		assigned += takes[h];
+		remainders[h] = std::make_pair(share - floor(share), h);
+	}
+	std::stable_sort(remainders.begin(), remainders.end(),
+		[](const std::pair<double, int>& a, const std::pair<double, int>& b) { return a.first > b.first; });
+	while (assigned < n) {
+		for (int k = 0; k < H && assigned < n; k++) {
+			int h = remainders[k].second;
+			if (takes[h] < strata[h].size()) {
+				takes[h]++;
+				assigned++;
+			}
+		}
+	}
+
+	// drawn without replacement by a partial Fisher-Yates shuffle
+	std::vector<int> sampled, stratumOf;
+	for (int h = 0; h < H; h++) {
+		std::vector<int>& stratum = strata[h];
+		int size = stratum.size();
+		int take = takes[h];
+		for (int k = 0; k < take; k++) {
+			std::uniform_int_distribution<int> pick(k, size - 1);
+			std::swap(stratum[k], stratum[pick(rng)]);
+			sampled.push_back(stratum[k]);
+			stratumOf.push_back(h);
+		}
+	}
+
+	int m = sampled.size();
+	std::vector<double> exact(m, 0.0);
+	if (periodic) {
+		std::vector<Complex> factors = StructureFactors(sources);
+		#pragma omp parallel for schedule(dynamic, 16)
+		for (int k = 0; k < m; k++)
+			exact[k] = EwaldPotential(targets[sampled[k]], sources, factors);
+		double offset = 0;
+		for (int k = 0; k < m; k++)
+			offset += targets[sampled[k]]->potential - exact[k];
+		offset /= m;
+		for (int k = 0; k < m; k++)
+			exact[k] += offset;
+	} else {
+		#pragma omp parallel for schedule(dynamic, 16)
+		for (int k = 0; k < m; k++) {
+			const Point* target = targets[sampled[k]];
+			double sum = 0;
+			for (auto &source : sources)
+				if (source->coord != target->coord)
+					sum += source->charge * potential.DirectEvaluate(target->coord, source->coord);
+			exact[k] = sum;
+		}
+	}
+
+	SampledError error = { m, N, H, 0, 0, 0, 0, 0, 0, 0 };
+	std::vector<StratumSums> sums(strata.size(), StratumSums{ 0, 0, 0, 0, 0 });
+	for (int k = 0; k < m; k++) {
+		double abs = fabs(targets[sampled[k]]->potential - exact[k]);
+		double rel = abs / fabs(exact[k]);
+		StratumSums& s = sums[stratumOf[k]];
+		s.abs += abs; s.abs2 += abs * abs;
+		s.rel += rel; s.rel2 += rel * rel;
+		s.count++;
+		error.maxAbsError = std::max(error.maxAbsError, abs);
+		error.maxRelError = std::max(error.maxRelError, rel);
+	}
+
+	// stratified estimators of the means and their variances with finite population correction.
+	// Strata with a single sample have no spread of their own; they get the spread pooled over
+	// the strata with more, or over the whole sample if there are none.
+	double pooledAbs = 0, pooledRel = 0, degreesOfFreedom = 0;
+	for (auto &s : sums) {
+		if (s.count > 1) {
+			pooledAbs += s.abs2 - s.abs * s.abs / s.count;
+			pooledRel += s.rel2 - s.rel * s.rel / s.count;
+			degreesOfFreedom += s.count - 1;
+		}
+	}
+	if (degreesOfFreedom > 0) {
+		pooledAbs /= degreesOfFreedom;
+		pooledRel /= degreesOfFreedom;
+	} else if (m > 1) {
+		double abs = 0, abs2 = 0, rel = 0, rel2 = 0;
+		for (auto &s : sums) {
+			abs += s.abs; abs2 += s.abs2;
+			rel += s.rel; rel2 += s.rel2;
+		}
+		pooledAbs = (abs2 - abs * abs / m) / (m - 1);
+		pooledRel = (rel2 - rel * rel / m) / (m - 1);
+	}
+	double absVariance = 0, relVariance = 0;
+	for (int h = 0; h < strata.size(); h++) {
+		StratumSums& s = sums[h];
+		double weight = (double)strata[h].size() / N;
+		error.avgAbsError += weight * s.abs / s.count;
+		error.avgRelError += weight * s.rel / s.count;
+		double correction = 1.0 - (double)s.count / strata[h].size();
+		double absSpread = pooledAbs, relSpread = pooledRel;
+		if (s.count > 1) {
+			absSpread = (s.abs2 - s.abs * s.abs / s.count) / (s.count - 1);
+			relSpread = (s.rel2 - s.rel * s.rel / s.count) / (s.count - 1);
+		}
+		absVariance += weight * weight * correction * std::max(absSpread, 0.0) / s.count;
+		relVariance += weight * weight * correction * std::max(relSpread, 0.0) / s.count;
+	}
+	error.avgAbsErrorCI = 1.96 * sqrt(absVariance);
+	error.avgRelErrorCI = 1.96 * sqrt(relVariance);
+
+	// if a fraction f of all targets exceeded the sample maximum, a sample of m would miss
+	// all of them with probability (1 - f)^m; solve (1 - f)^m = 0.05 for f
+	error.exceedanceBound = (m < N) ? 1.0 - pow(0.05, 1.0 / m) : 0.0;
+	return error;
+}
+
+void PrintSampledError(FILE* file, const SampledError& error)
+{
+	fprintf(file, "# sampled verification: %d of %d targets in %d strata\n", error.samples, error.population, error.strata);
+	fprintf(file, "%20s %12.4e +- %10.4e\n", "avg abs error", error.avgAbsError, error.avgAbsErrorCI);
+	fprintf(file, "%20s %12.4e +- %10.4e\n", "avg rel error", error.avgRelError, error.avgRelErrorCI);
+	fprintf(file, "%20s %12.4e\n", "max abs error", error.maxAbsError);
+	fprintf(file, "%20s %12.4e (exceeded by < %.2g%% of targets)\n", "max rel error", error.maxRelError, 100.0 * error.exceedanceBound);
+}
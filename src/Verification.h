@@ -0,0 +1,38 @@
+#ifndef Verification_h
+#define Verification_h
+
+#include <cstdio>
+#include "GeneralUtilities.h"
+#include "Point.h"
+#include "FMMPotential.h"
+
+/// Error statistics of approximate potentials over a sample of targets
+struct SampledError {
+	/// Number of sampled targets
+	int samples;
+	/// Number of targets sampled from
+	int population;
+	/// Number of strata the sample was drawn from, 1 if it was simple random
+	int strata;
+	/// Estimate of AvgAbsError over all targets and the half-width of its 95% confidence interval
+	double avgAbsError, avgAbsErrorCI;
+	/// Estimate of AvgRelError over all targets and the half-width of its 95% confidence interval
+	double avgRelError, avgRelErrorCI;
+	/// Largest absolute and relative error in the sample
+	double maxAbsError, maxRelError;
+	/// 95% upper bound on the fraction of all targets with a relative error above maxRelError
+	double exceedanceBound;
+};
+
+/// Compute exact potentials for a sample of targets against all sources and compare them with
+/// the approximate potentials already stored in the targets. With strataLevel > 0 the sample is
+/// stratified over the boxes of that level of the unit square, otherwise it is simple random.
+/// With periodic set the exact potentials are Ewald sums over the periodic images of the unit
+/// square; as these are defined up to a constant, the mean difference over the sample is removed.
+SampledError VerifySampled(const std::vector<Point*>& sources, const std::vector<Point*>& targets,
+	Potential& potential, const int samples, const unsigned seed, const int strataLevel = 0, const bool periodic = false);
+
+/// Print sampled error statistics
+void PrintSampledError(FILE* file, const SampledError& error);
+
+#endif